@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_adc_calibration_h_
+#define __app_adc_calibration_h_
+
+#include <zephyr.h>
+
+#include "app-adcs.h"
+
+/* Stored under "adc/cal/<input name>" */
+#define ADC_CAL_SETTINGS_ROOT       "adc"
+#define ADC_CAL_SETTINGS_SUBTREE    "cal"
+
+/* Anything further out than this is a wiring fault, not resistor tolerance */
+#define ADC_CAL_GAIN_MIN            (ADC_CAL_GAIN_ONE - (ADC_CAL_GAIN_ONE / 4))
+#define ADC_CAL_GAIN_MAX            (ADC_CAL_GAIN_ONE + (ADC_CAL_GAIN_ONE / 4))
+#define ADC_CAL_OFFSET_MAX_MV       200
+
+#define ADC_CAL_MAX_POINTS          2
+
+/*
+ * Calibrating an input against a known reference:
+ *
+ *   adc_calibration_begin(input)   - drops the old correction, samples fast
+ *   <apply the reference to the input>
+ *   adc_calibration_point(ref_mv)  - -EAGAIN until a full history is in
+ *   <optionally a second, different, reference>
+ *   adc_calibration_point(ref_mv)
+ *   adc_calibration_commit()       - works out gain/offset, saves to flash
+ *
+ * With one point only the gain is corrected.  adc_calibration_abort() puts
+ * the old correction back.  The display's calibration page (UP from a
+ * battery's page) walks through this for that battery's input.
+ */
+int adc_calibration_init(void);
+bool adc_calibration_active(void);
+int adc_calibration_points(void);
+int adc_calibration_begin(enum adc_input_names_t input_name);
+int adc_calibration_point(uint16_t reference_mv);
+int adc_calibration_commit(void);
+void adc_calibration_abort(void);
+
+#endif /* __app_adc_calibration_h_ */
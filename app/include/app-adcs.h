@@ -16,6 +16,44 @@
 #include <kernel.h>
 
 
+/*
+ * Recent readings of one input, in mV.  The ring is seeded with the first
+ * reading, so the moving average is always over a full ring and is a shift.
+ */
+#define ADC_HISTORY_SHIFT           3
+#define ADC_HISTORY_SIZE            BIT(ADC_HISTORY_SHIFT)
+
+/* IIR weight of a new reading is 1 / 2^ADC_IIR_SHIFT, state is in Q8 */
+#define ADC_IIR_SHIFT               2
+#define ADC_IIR_FRAC_BITS           8
+
+/* A step bigger than this (cell inserted or pulled) restarts the filters */
+#define ADC_FILTER_RESET_MV         500
+
+struct adc_history_t {
+    uint16_t samples[ADC_HISTORY_SIZE];
+    uint8_t head;
+    uint8_t count;
+    bool seeded;
+    uint32_t sum;
+    int32_t iir_q8;
+    uint16_t filtered_mv;
+    uint16_t mean_mv;
+    uint16_t min_mv;
+    uint16_t max_mv;
+};
+
+/*
+ * Correction on top of the nominal divider: mv = nominal * gain + offset.
+ * This is what gets stored in flash, see adc-calibration.c
+ */
+#define ADC_CAL_GAIN_ONE            BIT(16)
+
+struct adc_calibration_t {
+    uint32_t gain_q16;
+    int16_t offset_mv;
+};
+
 struct adc_inputs_t {
     char *name;
     uint16_t raw_value;
@@ -23,8 +61,75 @@ struct adc_inputs_t {
     uint16_t reference_mv;
     struct device **pdev;
     struct adc_channel_cfg config;
+    uint32_t timestamp;
+    bool active;
+    uint16_t interval_ms;
+    uint8_t resolution;
+    uint32_t precise_timestamp;
+    bool auto_range;
+    uint8_t pga_shift;
+    struct adc_history_t history;
+    bool calibrating;
+    struct adc_calibration_t cal;
+    uint32_t scale_q16;
 };
 
+/* MCP342x configuration register */
+#define MCP342X_CFG_RDY             BIT(7)
+#define MCP342X_CFG_CHANNEL(x)      (((x) & 0x03) << 5)
+#define MCP342X_CFG_CONTINUOUS      BIT(4)
+#define MCP342X_CFG_RATE_12BIT      (0x00 << 2)
+#define MCP342X_CFG_RATE_14BIT      (0x01 << 2)
+#define MCP342X_CFG_RATE_16BIT      (0x02 << 2)
+#define MCP342X_CFG_RATE(bits)      ((((bits) - 12) >> 1) << 2)
+#define MCP342X_CFG_GAIN(x)         ((x) & 0x03)
+
+/* 
+ * General call "conversion": every MCP342x on the bus starts a one-shot
+ * conversion at once.  Nothing else on sercom2 acts on this one (unlike 0x06,
+ * the general call reset, which would also reset the PCA9685).
+ */
+#define MCP342X_GENERAL_CALL_ADDR   0x00
+#define MCP342X_GENERAL_CALL_CONVERT 0x08
+
+#define MCP342X_CHANNEL_COUNT       4
+
+/*
+ * 12 bit at 240 SPS, 14 bit at 60 SPS, 16 bit at 15 SPS, plus some margin for
+ * the internal oscillator
+ */
+#define ADC_CONVERSION_12BIT_MS     6
+#define ADC_CONVERSION_14BIT_MS     20
+#define ADC_CONVERSION_16BIT_MS     70
+#define ADC_POLL_MS                 5
+
+/*
+ * Active inputs feed the cut-off loop, which wants a fresh reading more than
+ * it wants 16 bits, so they run at 12 bit with a 16 bit reading mixed in
+ * every ADC_PRECISION_INTERVAL_MS.  Idle inputs are always read at 16 bit.
+ */
+#define ADC_RESOLUTION_FAST         12
+#define ADC_RESOLUTION_PRECISE      16
+#define ADC_PRECISION_INTERVAL_MS   5000
+
+/*
+ * PGA auto-ranging, in terms of raw_value (16 bit scale, full scale 0x7FFF).
+ * The gain goes up a step when the reading is low enough to still be under
+ * ADC_RANGE_UP_RAW * 2 after doubling, and down a step when it is above
+ * ADC_RANGE_DOWN_RAW.  The gap between them is the hysteresis.
+ */
+#define ADC_PGA_SHIFT_MAX           3       /* x8 */
+#define ADC_RANGE_DOWN_RAW          29490   /* 90% of full scale */
+#define ADC_RANGE_UP_RAW            13106   /* 40% of full scale */
+#define ADC_RANGE_CLIPPED_RAW       0x7FF0
+#define ADC_ROUND_PERIOD_MS         250
+
+/* Sampling intervals, see adc_update_interval() */
+#define ADC_INTERVAL_ACTIVE_MS      ADC_ROUND_PERIOD_MS
+#define ADC_INTERVAL_IDLE_MS        5000
+#define ADC_FAST_DVDT_MV_PER_SEC    100
+#define ADC_DUE_SLACK_MS            (ADC_ROUND_PERIOD_MS / 2)
+
 #define FOR_ALL_ADCS(preamble, x, postamble)    \
 preamble                                        \
     x(VBATT1a, adc[0], 0, 2048)                 \
@@ -61,6 +166,16 @@ extern uint16_t adc_input_count;
 
 int adcs_init(void);
 void adcs_start(void);
+void adc_set_active(enum adc_input_names_t input_name, bool active);
+void adc_set_auto_range(enum adc_input_names_t input_name, bool auto_range);
+void adc_set_calibration(enum adc_input_names_t input_name,
+                         const struct adc_calibration_t *cal);
+void adc_set_calibrating(enum adc_input_names_t input_name, bool calibrating);
+bool adc_get_settled_mv(enum adc_input_names_t input_name, uint16_t *mean_mv);
+uint16_t adc_get_filtered_mv(enum adc_input_names_t input_name);
+uint16_t adc_get_mean_mv(enum adc_input_names_t input_name);
+uint16_t adc_get_min_mv(enum adc_input_names_t input_name);
+uint16_t adc_get_max_mv(enum adc_input_names_t input_name);
 
 
 #endif /* __app_adcs_h_ */
\ No newline at end of file
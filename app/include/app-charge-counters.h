@@ -11,6 +11,25 @@
 #include <kernel.h>
 #include "app-gpios.h"
 #include "app-devices.h"
+#include "app-adcs.h"
+
+/* Must be a power of 2 */
+#define CHARGE_PULSE_RING_SIZE  8
+
+/*
+ * Current from pulse spacing: one pulse is 1/3.255 C = 307.22 mC, so
+ * I(uA) = 307220000 / interval(ms).  Kept in uA so a coin cell's load still
+ * resolves.  With no pulses the current can be no more than one pulse over
+ * the time since the last one, and after the timeout it is taken as zero.
+ */
+#define CHARGE_UA_MS_PER_PULSE      307220000
+#define CHARGE_CURRENT_AVG_SHIFT    2
+#define CHARGE_CURRENT_TIMEOUT_MS   (30 * 60 * 1000)
+
+struct charge_pulse_t {
+    uint32_t timestamp;
+    bool positive;
+};
 
 struct charge_counter_t {
     int32_t raw_count;
@@ -19,12 +38,25 @@ struct charge_counter_t {
     enum io_names_t polarity;
     enum io_names_t interrupt;
     enum io_names_t shutdown;
-    struct k_delayed_work worker;
+    struct charge_pulse_t pulses[CHARGE_PULSE_RING_SIZE];
+    uint32_t pulse_count;
+    uint32_t pulses_missed;
+    bool int_active;
+    enum adc_input_names_t voltage;
+    int64_t energy_q32;
+    int32_t mWh;
+    uint32_t last_pulse_time;
+    uint32_t last_interval;
+    int32_t current_ua;
+    int32_t current_avg_ua;
 };
 
 
 int charge_counters_init(void);
-void charge_counters_start(void);
+void charge_counter_update(struct charge_counter_t *counter);
+int charge_counter_get_pulse(int index, int age, struct charge_pulse_t *pulse);
+int charge_counter_get_current(int index, int32_t *current_ua,
+                               int32_t *average_ua);
 
 extern struct charge_counter_t charge_counter[CHARGE_COUNTER_COUNT];
 
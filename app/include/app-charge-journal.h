@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_charge_journal_h_
+#define __app_charge_journal_h_
+
+#include <zephyr.h>
+
+#include "app-charge-counters.h"
+
+/*
+ * The counters and bank setup are checkpointed as one record under
+ * "journal/state" in settings.  The NVS backend appends each write and
+ * rotates through the storage partition, so that is the wear levelling.
+ * A checkpoint is skipped when nothing changed since the last one.
+ */
+#define CHARGE_JOURNAL_SETTINGS_ROOT    "journal"
+#define CHARGE_JOURNAL_SETTINGS_KEY     "state"
+#define CHARGE_JOURNAL_VERSION          1
+#define CHARGE_JOURNAL_INTERVAL_MS      (10 * 60 * 1000)
+#define CHARGE_JOURNAL_BANK_COUNT       10
+
+/* BOD33 level for the power fail checkpoint, ~3.07V typical */
+#define CHARGE_JOURNAL_BOD33_LEVEL      48
+
+struct charge_journal_counter_t {
+    int64_t energy_q32;
+    int32_t raw_count;
+    uint32_t pulse_count;
+    uint32_t pulses_missed;
+};
+
+struct charge_journal_bank_t {
+    int8_t battery_type_index;
+    bool enabled;
+    uint16_t min_voltage;
+    uint16_t max_voltage;
+};
+
+struct charge_journal_t {
+    uint16_t version;
+    struct charge_journal_counter_t counters[CHARGE_COUNTER_COUNT];
+    struct charge_journal_bank_t banks[CHARGE_JOURNAL_BANK_COUNT];
+};
+
+int charge_journal_init(void);
+void charge_journal_start(void);
+int charge_journal_checkpoint(void);
+void charge_journal_snapshot(struct charge_journal_t *journal);
+void charge_journal_apply(const struct charge_journal_t *journal, bool banks);
+void charge_journal_set_interval(uint32_t interval_ms);
+
+#endif /* __app_charge_journal_h_ */
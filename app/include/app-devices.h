@@ -14,6 +14,7 @@
 #define ADC_COUNT   6
 #define CHARGE_COUNTER_COUNT    6
 
+extern const struct device *i2c;
 extern const struct device *porta;
 extern const struct device *ioexp[IOEXP_COUNT];
 extern const struct device *adc[ADC_COUNT];
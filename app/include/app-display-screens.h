@@ -28,6 +28,7 @@ struct display_menu_t {
     menu_action right;
     menu_action down;
     menu_action enter;
+    menu_action esc;
 };
 
 struct display_menu_ram_t {
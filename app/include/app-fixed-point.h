@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_fixed_point_h_
+#define __app_fixed_point_h_
+
+#include <zephyr.h>
+
+#include "app-utils.h"
+
+/*
+ * The M0+ has no divide instruction, so a divide is a libgcc call costing
+ * a few hundred cycles.  Dividing by a constant is done here as a multiply
+ * by its reciprocal and a shift instead.  Every helper states the range it
+ * is exact over (checked exhaustively against the real divide).
+ */
+
+/* ceil((num << shift) / divisor), for building reciprocals at compile time */
+#define FP_RATIO(num, divisor, shift)                                       \
+    ((uint32_t)(((((uint64_t)(num)) << (shift)) + (divisor) - 1) / (divisor)))
+#define FP_RECIPROCAL(divisor, shift)   FP_RATIO(1, divisor, shift)
+
+/*
+ * Multiply by a Q32 fraction, truncating towards zero like a C divide does.
+ * Use FP_RATIO(num, divisor, 32) to get x * num / divisor.
+ */
+static inline int32_t fp_scale_q32(int32_t x, uint32_t ratio_q32)
+{
+    uint32_t magnitude = ((uint64_t)(uint32_t)_abs(x) * ratio_q32) >> 32;
+    
+    return x < 0 ? -(int32_t)magnitude : (int32_t)magnitude;
+}
+
+/* x / 100, exact for x <= 43698 */
+static inline uint16_t fp_div100(uint16_t x)
+{
+    return ((uint32_t)x * 5243) >> 19;
+}
+
+/*
+ * delta * 100 / span, for a span known ahead of time.  The reciprocal comes
+ * from FP_PERCENT_RECIPROCAL(span), and the result is exact for
+ * 0 <= delta <= span < 4096, and for every span in FOR_ALL_BAT_TYPES.
+ */
+#define FP_PERCENT_SHIFT                24
+#define FP_PERCENT_RECIPROCAL(span)     FP_RATIO(100, span, FP_PERCENT_SHIFT)
+
+static inline uint8_t fp_percent(uint32_t delta, uint32_t reciprocal)
+{
+    return (delta * reciprocal) >> FP_PERCENT_SHIFT;
+}
+
+#endif /* __app_fixed_point_h_ */
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_format_h_
+#define __app_format_h_
+
+#include <zephyr.h>
+
+/*
+ * Small fixed width formatters for the UI, in place of snprintf.  Numbers are
+ * right aligned and space padded to the given width (longer numbers just
+ * overflow it), and the digits come from repeated subtraction, not divides.
+ */
+
+/* Enough for a full display line of 21 characters, plus the NUL */
+#define FORMAT_BUFFER_SIZE      22
+
+#define FORMAT_VOLTS_WIDTH      6   /* "65.535" */
+#define FORMAT_MAH_WIDTH        6
+#define FORMAT_MS_WIDTH         7   /* "999.999" */
+#define FORMAT_MA_WIDTH         8   /* "-999.999" */
+
+int format_fixed(char *buf, int32_t value, int width, int decimals);
+char *format_millivolts(char *buf, int32_t mv);
+char *format_mah(char *buf, int32_t mAh);
+char *format_microseconds(char *buf, int32_t us);
+char *format_microamps(char *buf, int32_t ua);
+
+#endif /* __app_format_h_ */
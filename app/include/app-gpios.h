@@ -16,7 +16,6 @@
 
 struct io_pins_t {
     char *name;
-    bool value;
     struct device **pdev;
     int pin;
     uint32_t io_flags;
@@ -24,22 +23,36 @@ struct io_pins_t {
     uint32_t interrupt_flags;
     struct gpio_callback callback;
     gpio_callback_handler_t handler;
-    uint64_t expiry;
 };
 
+struct io_device_t {
+    char *name;
+    struct device **pdev;
+    uint16_t addr;
+    uint8_t first;
+    uint8_t last;
+    uint32_t pin_mask;
+    uint32_t input_mask;
+    uint32_t output_mask;
+    uint32_t active_low_mask;
+    uint32_t interrupt_mask;
+    uint32_t falling_mask;
+    uint32_t rising_mask;
+};
 
 
-#define FOR_ALL_IOS(preamble, x, postamble)                                 \
-preamble                                                                    \
-    x(EXT_nINT, porta, 0, GPIO_INPUT, true, 0, GPIO_INT_EDGE_FALLING)       \
+
+#define IOS_PORTA(x)                                                        \
+    x(EXT_nINT, porta, 0, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)       \
     x(nOE, porta, 1, GPIO_OUTPUT_HIGH, true, 0, 0x00)                       \
     x(LEDBootR, porta, 23, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
     x(LEDBootG, porta, 22, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
     x(LEDCPUg, porta, 25, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)               \
-    x(LEDCPUr, porta, 24, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)               \
-                                                                            \
+    x(LEDCPUr, porta, 24, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP0(x)                                                       \
     x(nSD1, ioexp[0], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INT1, ioexp[0], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INT1, ioexp[0], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POL1, ioexp[0], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(PWRGD1, ioexp[0], 3, GPIO_INPUT, false, 1, GPIO_INT_EDGE_BOTH)        \
     x(LED1ar, ioexp[0], 8, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
@@ -47,10 +60,11 @@ preamble                                                                    \
     x(LED1br, ioexp[0], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(LED1bg, ioexp[0], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(BATSEL1a, ioexp[0], 12, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-    x(BATSEL1b, ioexp[0], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-                                                                            \
+    x(BATSEL1b, ioexp[0], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP1(x)                                                       \
     x(nSD2, ioexp[1], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INT2, ioexp[1], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INT2, ioexp[1], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POL2, ioexp[1], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(PWRGD2, ioexp[1], 3, GPIO_INPUT, false, 1, GPIO_INT_EDGE_BOTH)        \
     x(LED2ar, ioexp[1], 8, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
@@ -58,10 +72,11 @@ preamble                                                                    \
     x(LED2br, ioexp[1], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(LED2bg, ioexp[1], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(BATSEL2a, ioexp[1], 12, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-    x(BATSEL2b, ioexp[1], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-                                                                            \
+    x(BATSEL2b, ioexp[1], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP2(x)                                                       \
     x(nSD3, ioexp[2], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INT3, ioexp[2], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INT3, ioexp[2], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POL3, ioexp[2], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(PWRGD3, ioexp[2], 3, GPIO_INPUT, false, 1, GPIO_INT_EDGE_BOTH)        \
     x(LED3ar, ioexp[2], 8, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
@@ -69,10 +84,11 @@ preamble                                                                    \
     x(LED3br, ioexp[2], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(LED3bg, ioexp[2], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(BATSEL3a, ioexp[2], 12, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-    x(BATSEL3b, ioexp[2], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-                                                                            \
+    x(BATSEL3b, ioexp[2], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP3(x)                                                       \
     x(nSD4, ioexp[3], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INT4, ioexp[3], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INT4, ioexp[3], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POL4, ioexp[3], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(PWRGD4, ioexp[3], 3, GPIO_INPUT, false, 1, GPIO_INT_EDGE_BOTH)        \
     x(LED4ar, ioexp[3], 8, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
@@ -80,10 +96,11 @@ preamble                                                                    \
     x(LED4br, ioexp[3], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(LED4bg, ioexp[3], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(BATSEL4a, ioexp[3], 12, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-    x(BATSEL4b, ioexp[3], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-                                                                            \
+    x(BATSEL4b, ioexp[3], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP4(x)                                                       \
     x(nSD5, ioexp[4], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INT5, ioexp[4], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INT5, ioexp[4], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POL5, ioexp[4], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(PWRGD5, ioexp[4], 3, GPIO_INPUT, false, 1, GPIO_INT_EDGE_BOTH)        \
     x(LED5ar, ioexp[4], 8, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
@@ -91,8 +108,9 @@ preamble                                                                    \
     x(LED5br, ioexp[4], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(LED5bg, ioexp[4], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)             \
     x(BATSEL5a, ioexp[4], 12, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-    x(BATSEL5b, ioexp[4], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
-                                                                            \
+    x(BATSEL5b, ioexp[4], 13, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+#define IOS_IOEXP5(x)                                                       \
     x(BATT1_INT, ioexp[5], 0, GPIO_INPUT, true, 0, GPIO_INT_EDGE_FALLING)   \
     x(BATT2_INT, ioexp[5], 1, GPIO_INPUT, true, 0, GPIO_INT_EDGE_FALLING)   \
     x(BATT3_INT, ioexp[5], 2, GPIO_INPUT, true, 0, GPIO_INT_EDGE_FALLING)   \
@@ -104,16 +122,44 @@ preamble                                                                    \
     x(RIGHT, ioexp[5], 10, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)      \
     x(DOWN, ioexp[5], 11, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)       \
     x(ENTER, ioexp[5], 12, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)      \
-    x(ESC, ioexp[5], 13, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
-                                                                            \
+    x(ESC, ioexp[5], 13, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)
+
+#define IOS_IOEXP6(x)                                                       \
     x(nSDO, ioexp[6], 0, GPIO_OUTPUT_HIGH, true, 0, 0x00)                   \
-    x(INTO, ioexp[6], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_FALLING)        \
+    x(INTO, ioexp[6], 1, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)           \
     x(POLO, ioexp[6], 2, GPIO_INPUT, false, 0, 0x00)                        \
     x(LEDActive, ioexp[6], 3, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)           \
     x(nSTANDBY, ioexp[6], 8, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)       \
     x(nCHARGE, ioexp[6], 9, GPIO_INPUT, true, 1, GPIO_INT_EDGE_BOTH)        \
     x(LEDOr, ioexp[6], 10, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
-    x(LEDOg, ioexp[6], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)              \
+    x(LEDOg, ioexp[6], 11, GPIO_OUTPUT_ACTIVE, false, 0, 0x00)
+
+/*
+ * Every device's IOs are kept together and in this order, so that each device
+ * occupies a contiguous range of io_names_t.
+ */
+#define FOR_ALL_IO_DEVS(preamble, x, postamble)                             \
+preamble                                                                    \
+    x(PORTA, porta, IOS_PORTA, 0x00)                                        \
+    x(IOEXP0, ioexp[0], IOS_IOEXP0, DT_REG_ADDR(DT_NODELABEL(ioexp0)))      \
+    x(IOEXP1, ioexp[1], IOS_IOEXP1, DT_REG_ADDR(DT_NODELABEL(ioexp1)))      \
+    x(IOEXP2, ioexp[2], IOS_IOEXP2, DT_REG_ADDR(DT_NODELABEL(ioexp2)))      \
+    x(IOEXP3, ioexp[3], IOS_IOEXP3, DT_REG_ADDR(DT_NODELABEL(ioexp3)))      \
+    x(IOEXP4, ioexp[4], IOS_IOEXP4, DT_REG_ADDR(DT_NODELABEL(ioexp4)))      \
+    x(IOEXP5, ioexp[5], IOS_IOEXP5, DT_REG_ADDR(DT_NODELABEL(ioexp5)))      \
+    x(IOEXP6, ioexp[6], IOS_IOEXP6, DT_REG_ADDR(DT_NODELABEL(ioexp6)))      \
+postamble
+
+#define FOR_ALL_IOS(preamble, x, postamble)                                 \
+preamble                                                                    \
+    IOS_PORTA(x)                                                            \
+    IOS_IOEXP0(x)                                                           \
+    IOS_IOEXP1(x)                                                           \
+    IOS_IOEXP2(x)                                                           \
+    IOS_IOEXP3(x)                                                           \
+    IOS_IOEXP4(x)                                                           \
+    IOS_IOEXP5(x)                                                           \
+    IOS_IOEXP6(x)                                                           \
 postamble
 
 #define IO_ENUM(label, ...) label,
@@ -121,14 +167,49 @@ postamble
 FOR_ALL_IOS(enum io_names_t {, IO_ENUM, };)
 
 
+#define IO_DEV_ENUM(label, ...) IODEV_##label,
+
+FOR_ALL_IO_DEVS(enum io_device_names_t {, IO_DEV_ENUM, IODEV_COUNT };)
+
+
+/* Per-device bitmasks, built by OR-ing one term per IO on the device */
+#define IO_COUNT_ONE(...)   + 1
+#define IO_PIN_BIT(label, dev, pin, ...)    | BIT(pin)
+#define IO_INPUT_BIT(label, dev, pin, io_flags, ...)                        \
+    | ((((io_flags) & GPIO_INPUT) == GPIO_INPUT) ? BIT(pin) : 0)
+#define IO_OUTPUT_BIT(label, dev, pin, io_flags, ...)                       \
+    | ((((io_flags) & GPIO_OUTPUT) == GPIO_OUTPUT) ? BIT(pin) : 0)
+#define IO_ACTIVE_LOW_BIT(label, dev, pin, io_flags, is_active_low, ...)    \
+    | ((is_active_low) ? BIT(pin) : 0)
+#define IO_INTERRUPT_BIT(label, dev, pin, io_flags, is_active_low, is_interrupt, ...) \
+    | ((is_interrupt) ? BIT(pin) : 0)
+#define IO_FALLING_BIT(label, dev, pin, io_flags, is_active_low, is_interrupt, interrupt_flags) \
+    | (((interrupt_flags) & GPIO_INT_EDGE_FALLING) ? BIT(pin) : 0)
+#define IO_RISING_BIT(label, dev, pin, io_flags, is_active_low, is_interrupt, interrupt_flags) \
+    | (((interrupt_flags) & GPIO_INT_EDGE_RISING) ? BIT(pin) : 0)
+
+/* IO_FIRST_x and IO_LAST_x bracket each device's range of io_names_t */
+#define IO_DEV_BOUNDS(label, dev, ios, ...)                                 \
+    IO_FIRST_##label, IO_LAST_##label = IO_FIRST_##label + (0 ios(IO_COUNT_ONE)) - 1,
+
+FOR_ALL_IO_DEVS(enum io_device_bounds_t {, IO_DEV_BOUNDS, };)
+
+
 extern struct io_pins_t io_pins[];
 extern uint16_t io_count;
+extern const struct io_device_t io_devices[];
+extern const uint8_t io_pin_device[];
 
 #define IS_INPUT(x)     ((io_pins[x].io_flags & GPIO_INPUT) == GPIO_INPUT)
 #define IS_OUTPUT(x)    ((io_pins[x].io_flags & GPIO_OUTPUT) == GPIO_OUTPUT)
 
+void io_transaction_begin(void);
+int io_transaction_commit(void);
 void write_io_pin(enum io_names_t io_name, bool value);
 int read_io_pin(enum io_names_t io_name, bool *outval);
+void io_device_update(int index, uint32_t portval);
+uint32_t io_device_value(int index);
+uint32_t io_device_pending(int index);
 int gpios_init(void);
 
 #endif /* __app_gpios_h_ */
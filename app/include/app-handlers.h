@@ -11,7 +11,8 @@
 #include "app-gpios.h"
 
 
-void handler_charge_counter(enum io_names_t pin_name);
+void handler_charge_counter(enum io_names_t pin_name, uint32_t state,
+                            uint32_t timestamp);
 void handler_power_good(enum io_names_t pin_name);
 void handler_charger(enum io_names_t pin_name);
 void handler_button(enum io_names_t pin_name);
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_i2c_sched_h_
+#define __app_i2c_sched_h_
+
+#include <zephyr.h>
+#include <kernel.h>
+
+/* In order of precedence, highest first */
+enum i2c_priority_t {
+    I2C_PRIO_SAFETY,
+    I2C_PRIO_COUNTER,
+    I2C_PRIO_ADC,
+    I2C_PRIO_DISPLAY,
+    I2C_PRIO_COUNT
+};
+
+/*
+ * Approximate bytes on the wire for transactions made through drivers, where
+ * we don't see the buffers.  Register address plus payload.
+ */
+#define I2C_BYTES_PORT_WRITE        3
+#define I2C_BYTES_PORT_READ         3
+#define I2C_BYTES_ADC_CHANNEL       4
+#define I2C_BYTES_DISPLAY_FLUSH     1030
+
+struct i2c_sched_class_t {
+    struct k_sem grant;
+    int waiting;
+};
+
+int i2c_sched_init(void);
+void i2c_sched_begin(enum i2c_priority_t priority, uint16_t addr);
+void i2c_sched_end(size_t bytes);
+
+#endif /* __app_i2c_sched_h_ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_i2c_stats_h_
+#define __app_i2c_stats_h_
+
+#include <zephyr.h>
+#include <kernel.h>
+
+/* Room for every device on the bus */
+#define I2C_STATS_DEVICE_COUNT  16
+
+enum i2c_stats_window_name_t {
+    I2C_STATS_SECOND,
+    I2C_STATS_MINUTE,
+    I2C_STATS_WINDOW_COUNT
+};
+
+/*
+ * Each window is rolling, made up of its last few complete buckets, so it
+ * is never more than one bucket behind.  The bucket being filled is the
+ * extra one in the ring.
+ */
+#define I2C_STATS_SECOND_BUCKETS    4       /* of 250ms */
+#define I2C_STATS_MINUTE_BUCKETS    4       /* of 15s */
+#define I2C_STATS_BUCKET_COUNT      (I2C_STATS_SECOND_BUCKETS + 1 + \
+                                     I2C_STATS_MINUTE_BUCKETS + 1)
+
+struct i2c_stats_window_t {
+    uint32_t transactions;
+    uint32_t bytes;
+    uint32_t busy_us;
+    uint32_t max_latency_us;
+};
+
+/*
+ * There is one per device per bucket.  The latency is a full 32 bits, as the
+ * long stalls are the ones worth seeing.
+ */
+struct i2c_stats_bucket_t {
+    uint16_t transactions;
+    uint32_t max_latency_us;
+    uint32_t bytes;
+    uint32_t busy_us;
+};
+
+struct i2c_stats_t {
+    uint16_t addr;
+    uint32_t period[I2C_STATS_WINDOW_COUNT];
+    struct i2c_stats_bucket_t buckets[I2C_STATS_BUCKET_COUNT];
+};
+
+void i2c_stats_record(uint16_t addr, size_t bytes, uint32_t busy_cycles,
+                      uint32_t latency_cycles);
+int i2c_stats_get(uint16_t addr, enum i2c_stats_window_name_t window,
+                  struct i2c_stats_window_t *stats);
+int i2c_stats_get_total(enum i2c_stats_window_name_t window,
+                        struct i2c_stats_window_t *stats);
+int i2c_stats_device_addr(int index, uint16_t *addr);
+
+#endif /* __app_i2c_stats_h_ */
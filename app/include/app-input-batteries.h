@@ -17,11 +17,30 @@ struct battery_type_t {
     char *name;
     uint16_t max_voltage;
     uint16_t min_voltage;
+    uint32_t percent_reciprocal;
+};
+
+/*
+ * A running battery below its type's minimum goes LOW, and is cut off as
+ * DEPLETED once it has stayed there for BATTERY_DEPLETION_DEBOUNCE_MS.  It
+ * has to come back above the minimum by 1/2^BATTERY_DEPLETION_HYST_SHIFT of
+ * its type's range to count as recovered.  Only readings under load count,
+ * as a cell that isn't being drawn on sits well above where it sags to.
+ */
+#define BATTERY_DEPLETION_CHECK_MS      100
+#define BATTERY_DEPLETION_DEBOUNCE_MS   5000
+#define BATTERY_DEPLETION_HYST_SHIFT    5
+
+enum battery_depletion_t {
+    BATTERY_OK,
+    BATTERY_LOW,
+    BATTERY_DEPLETED,
 };
 
 struct battery_worker_t {
     char *name;
     enum adc_input_names_t signal;
+    enum adc_input_names_t output;
     enum io_names_t select;
     enum io_names_t green;
     enum io_names_t red;
@@ -34,6 +53,8 @@ struct battery_worker_t {
     int battery_type_index;
     struct battery_type_t battery_type;
     uint32_t battery_choice_bits;
+    enum battery_depletion_t depletion;
+    uint32_t low_since;
 };
 
 
@@ -68,18 +89,21 @@ postamble
 
 #define FOR_ALL_BATS(preamble, x, postamble)                            \
 preamble                                                                \
-    x(BATT1a, BATSEL1a, LED1ag, LED1ar, nSD1, 0, BAT_CHOICE_AA)         \
-    x(BATT1b, BATSEL1b, LED1bg, LED1br, nSD1, 0, BAT_CHOICE_AAA)        \
-    x(BATT2a, BATSEL2a, LED2ag, LED2ar, nSD2, 1, BAT_CHOICE_AA)         \
-    x(BATT2b, BATSEL2b, LED2bg, LED2br, nSD2, 1, BIT(External_3V3))     \
-    x(BATT3a, BATSEL3a, LED3ag, LED3ar, nSD3, 2, BAT_CHOICE_AA)         \
-    x(BATT3b, BATSEL3b, LED3bg, LED3br, nSD3, 2, BIT(CR2032))           \
-    x(BATT4a, BATSEL4a, LED4ag, LED4ar, nSD4, 3, BAT_CHOICE_AA)         \
-    x(BATT4b, BATSEL4b, LED4bg, LED4br, nSD4, 3, BIT(CR123A))           \
-    x(BATT5a, BATSEL5a, LED5ag, LED5ar, nSD5, 4, BIT(External_12V))     \
-    x(BATT5b, BATSEL5b, LED5bg, LED5br, nSD5, 4, BAT_CHOICE_9V)         \
+    x(BATT1a, BATSEL1a, LED1ag, LED1ar, nSD1, VOUT1, 0, BAT_CHOICE_AA)  \
+    x(BATT1b, BATSEL1b, LED1bg, LED1br, nSD1, VOUT1, 0, BAT_CHOICE_AAA) \
+    x(BATT2a, BATSEL2a, LED2ag, LED2ar, nSD2, VOUT2, 1, BAT_CHOICE_AA)  \
+    x(BATT2b, BATSEL2b, LED2bg, LED2br, nSD2, VOUT2, 1, BIT(External_3V3))\
+    x(BATT3a, BATSEL3a, LED3ag, LED3ar, nSD3, VOUT3, 2, BAT_CHOICE_AA)  \
+    x(BATT3b, BATSEL3b, LED3bg, LED3br, nSD3, VOUT3, 2, BIT(CR2032))    \
+    x(BATT4a, BATSEL4a, LED4ag, LED4ar, nSD4, VOUT4, 3, BAT_CHOICE_AA)  \
+    x(BATT4b, BATSEL4b, LED4bg, LED4br, nSD4, VOUT4, 3, BIT(CR123A))    \
+    x(BATT5a, BATSEL5a, LED5ag, LED5ar, nSD5, VOUT5, 4, BIT(External_12V))\
+    x(BATT5b, BATSEL5b, LED5bg, LED5br, nSD5, VOUT5, 4, BAT_CHOICE_9V)  \
 postamble
 
+/* Two batteries to a bank, and one PWM channel per bank */
+#define BATTERY_BANK_COUNT  5
+
 #define BAT_ENUM(label, ...) label,
 FOR_ALL_BATS(enum battery_t {, BAT_ENUM, };)
 
@@ -91,9 +115,17 @@ extern const struct battery_type_t battery_types[];
 extern size_t battery_type_count;
 
 int input_batteries_init(void);
+void input_batteries_start(void);
 uint8_t approximate_battery_level(int battery_index);
 bool battery_enabled(int battery_index);
 void battery_set_enabled(int battery_index, bool enabled);
+void battery_set_voltage_limits(int battery_index, uint16_t min_voltage,
+                                uint16_t max_voltage);
+void battery_set_type(int battery_index, int type_index);
+uint16_t battery_pwm_mask(void);
+void battery_pwm_weights(uint16_t *weights);
+void battery_pwm_set_weights(const uint16_t *weights);
+void battery_pwm_restore(uint16_t pwm_mask, const uint16_t *weights);
 
 
 #endif /* __app_input_batteries_h_ */
\ No newline at end of file
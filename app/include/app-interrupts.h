@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_interrupts_h_
+#define __app_interrupts_h_
+
+#include <zephyr.h>
+#include <kernel.h>
+#include "app-gpios.h"
+
+/* MCP23017 registers, IOCON.BANK = 0 */
+#define MCP23017_REG_GPINTENA   0x04
+#define MCP23017_REG_DEFVALA    0x06
+#define MCP23017_REG_INTCONA    0x08
+#define MCP23017_REG_IOCON      0x0A
+#define MCP23017_REG_INTFA      0x0E
+#define MCP23017_REG_INTCAPA    0x10
+#define MCP23017_REG_GPIOA      0x12
+
+#define MCP23017_IOCON_MIRROR   BIT(6)
+
+#define INTERRUPT_THREAD_STACK_SIZE 768
+#define INTERRUPT_THREAD_PRIORITY   K_PRIO_COOP(2)
+
+/* How many times to re-walk the tree while EXT_nINT stays asserted */
+#define INTERRUPT_CASCADE_RETRIES   4
+
+/* Must be a power of 2 */
+#define IO_EVENT_QUEUE_SIZE 16
+
+struct io_event_t {
+    uint32_t timestamp;
+    uint32_t pins;
+    uint8_t device;
+    atomic_t ready;
+};
+
+/*
+ * The expander interrupt tree: each child device's INT output is wired to an
+ * input on ioexp5, and ioexp5's INT output is EXT_nINT on porta.
+ */
+#define FOR_ALL_CASCADES(preamble, x, postamble)    \
+preamble                                            \
+    x(BATT1_INT, IODEV_IOEXP0)                      \
+    x(BATT2_INT, IODEV_IOEXP1)                      \
+    x(BATT3_INT, IODEV_IOEXP2)                      \
+    x(BATT4_INT, IODEV_IOEXP3)                      \
+    x(BATT5_INT, IODEV_IOEXP4)                      \
+    x(OUT_INT, IODEV_IOEXP6)                        \
+postamble
+
+struct interrupt_cascade_t {
+    enum io_names_t parent_pin;
+    enum io_device_names_t child;
+};
+
+int interrupts_init(void);
+int interrupts_start(void);
+void interrupts_post(enum io_device_names_t device, uint32_t pins);
+
+#endif /* __app_interrupts_h_ */
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_mppt_h_
+#define __app_mppt_h_
+
+#include <zephyr.h>
+
+/*
+ * Perturb and observe on the banks' PWM weights.  One bank's weight at a
+ * time is nudged up or down by 1/2^MPPT_STEP_SHIFT, the power into the
+ * output cell is measured from the output charge counter, and a step that
+ * lowered that power is undone and the bank's direction flipped.  The counters only pulse every
+ * few seconds, so each step settles first and then measures across at
+ * least MPPT_MIN_PULSES output pulses, giving up at MPPT_MAX_DWELL_MS.
+ */
+#define MPPT_STEP_SHIFT     3
+#define MPPT_SETTLE_MS      (30 * 1000)
+#define MPPT_POLL_MS        (10 * 1000)
+#define MPPT_MIN_PULSES     8
+#define MPPT_MAX_DWELL_MS   (10 * 60 * 1000)
+
+int mppt_init(void);
+void mppt_start(void);
+
+#endif /* __app_mppt_h_ */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_pwm_frame_h_
+#define __app_pwm_frame_h_
+
+#include <zephyr.h>
+
+/* PCA9685 registers */
+#define PCA9685_REG_MODE1       0x00
+#define PCA9685_REG_MODE2       0x01
+#define PCA9685_REG_LED0_ON_L   0x06
+#define PCA9685_REG_LED(ch)     (PCA9685_REG_LED0_ON_L + (4 * (ch)))
+
+#define PCA9685_MODE1_AI        BIT(5)
+#define PCA9685_MODE2_OCH       BIT(3)      /* set: outputs change on ACK */
+
+#define PCA9685_CHANNEL_COUNT   16
+#define PCA9685_COUNTS          4096
+
+/*
+ * ON/OFF counts for a channel.  PCA9685_COUNTS in either one is the full
+ * on/full off bit (bit 4 of the _H register), so it can be written as is.
+ */
+#define PWM_FRAME_FULL          PCA9685_COUNTS
+
+/*
+ * Every channel's ON/OFF registers, kept in RAM.  mask marks the channels
+ * that need writing, and a write is one auto-increment burst from the first
+ * marked channel to the last, so every channel in that range has to hold
+ * valid values (unmarked ones are just rewritten as they are).  The PCA9685
+ * is left updating on STOP, so the whole burst lands at once.
+ */
+struct pwm_frame_t {
+    uint16_t on[PCA9685_CHANNEL_COUNT];
+    uint16_t off[PCA9685_CHANNEL_COUNT];
+    uint16_t mask;
+};
+
+/* One PWM period at ~1kHz, plus margin */
+#define PWM_FRAME_SETTLE_MS     2
+
+int pwm_frame_init(void);
+void pwm_frame_clear(struct pwm_frame_t *frame);
+void pwm_frame_set(struct pwm_frame_t *frame, int channel, uint16_t on,
+                   uint16_t off);
+void pwm_frame_set_off(struct pwm_frame_t *frame, int channel);
+int pwm_frame_write(const struct pwm_frame_t *frame);
+int pwm_frame_transition(struct pwm_frame_t *current,
+                         const struct pwm_frame_t *target);
+
+#endif /* __app_pwm_frame_h_ */
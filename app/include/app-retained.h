@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_retained_h_
+#define __app_retained_h_
+
+#include <zephyr.h>
+
+#include "app-gpios.h"
+#include "app-input-batteries.h"
+#include "app-charge-journal.h"
+
+/*
+ * State kept in RAM that isn't cleared on reset, so a watchdog or software
+ * reset comes back up with the banks still running instead of dropping
+ * every output.  A power on leaves garbage here, which fails the CRCs.
+ *
+ * It is in two parts with a CRC each.  The outputs, and the bank state that
+ * drives them, are small and kept up to date on every change.  The journal
+ * changes on every counter pulse, so it is only marked dirty then, and
+ * rewritten at most every RETAINED_JOURNAL_FLUSH_MS.  A reset in between
+ * loses that last bit of counting, or the whole journal if it lands mid
+ * write, in which case the counters come from flash instead.
+ */
+#define RETAINED_MAGIC      0x4a545254      /* "JTRT" */
+#define RETAINED_JOURNAL_FLUSH_MS   1000
+
+struct retained_outputs_t {
+    uint32_t outputs[IODEV_COUNT];
+    uint16_t pwm_mask;
+    uint16_t power_good_mask;
+    uint16_t enabled_mask;
+    uint16_t pwm_weights[BATTERY_BANK_COUNT];
+};
+
+struct retained_state_t {
+    uint32_t magic;
+    struct retained_outputs_t outputs;
+    uint32_t outputs_crc;
+    struct charge_journal_t journal;
+    uint32_t journal_crc;
+};
+
+int retained_init(void);
+bool retained_journal_valid(void);
+bool retained_output(enum io_names_t io_name, bool *value);
+void retained_restore(void);
+void retained_start(void);
+void retained_update(void);
+void retained_journal_dirty(void);
+
+#endif /* __app_retained_h_ */
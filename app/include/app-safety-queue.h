@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __app_safety_queue_h_
+#define __app_safety_queue_h_
+
+#include <zephyr.h>
+#include <kernel.h>
+
+/*
+ * A work queue of its own for what switches the banks off: the PWM worker
+ * (which also drives the nSDx shutdowns) and the depletion check, and for
+ * the power fail checkpoint, which is in a hurry too.  On the
+ * system work queue they would wait for whatever is running there to
+ * return, a display redraw and flush included.  Here they only wait for
+ * the interrupt thread, and on the bus for the one transaction already on
+ * it.
+ */
+#define SAFETY_QUEUE_STACK_SIZE     1536    /* room for a settings save */
+#define SAFETY_QUEUE_PRIORITY       K_PRIO_COOP(3)
+
+extern struct k_work_q safety_work_q;
+
+int safety_queue_init(void);
+
+#endif /* __app_safety_queue_h_ */
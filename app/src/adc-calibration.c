@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <stdio.h>
+#include <string.h>
+#include <settings/settings.h>
+
+#include "app-utils.h"
+#include "app-adcs.h"
+#include "app-adc-calibration.h"
+
+
+struct adc_calibration_session_t {
+    bool active;
+    enum adc_input_names_t input;
+    struct adc_calibration_t previous;
+    int points;
+    uint16_t reference_mv[ADC_CAL_MAX_POINTS];
+    uint16_t measured_mv[ADC_CAL_MAX_POINTS];
+};
+
+static struct adc_calibration_session_t adc_cal_session;
+
+static const struct adc_calibration_t adc_cal_identity = {
+    ADC_CAL_GAIN_ONE, 0
+};
+
+
+static int adc_calibration_find(const char *name)
+{
+    for (int i = 0; i < adc_input_count; i++) {
+        if (!strcmp(adc_inputs[i].name, name)) {
+            return i;
+        }
+    }
+    
+    return -ENOENT;
+}
+
+static bool adc_calibration_valid(const struct adc_calibration_t *cal)
+{
+    return cal->gain_q16 >= ADC_CAL_GAIN_MIN &&
+           cal->gain_q16 <= ADC_CAL_GAIN_MAX &&
+           _abs(cal->offset_mv) <= ADC_CAL_OFFSET_MAX_MV;
+}
+
+static int adc_calibration_set(const char *key, size_t len,
+                               settings_read_cb read_cb, void *cb_arg)
+{
+    struct adc_calibration_t cal;
+    const char *next;
+    ssize_t ret;
+    int index;
+    
+    if (!settings_name_steq(key, ADC_CAL_SETTINGS_SUBTREE, &next) || !next) {
+        return -ENOENT;
+    }
+    
+    if (len != sizeof(cal)) {
+        return -EINVAL;
+    }
+    
+    index = adc_calibration_find(next);
+    if (index < 0) {
+        /* An input that has since gone from the table, ignore it */
+        return 0;
+    }
+    
+    ret = read_cb(cb_arg, &cal, sizeof(cal));
+    if (ret != sizeof(cal)) {
+        return -EIO;
+    }
+    
+    if (!adc_calibration_valid(&cal)) {
+        return -EINVAL;
+    }
+    
+    adc_set_calibration(index, &cal);
+    return 0;
+}
+
+static struct settings_handler adc_calibration_handler = {
+    .name = ADC_CAL_SETTINGS_ROOT,
+    .h_set = adc_calibration_set,
+};
+
+
+int adc_calibration_init(void)
+{
+    int ret;
+    
+    adc_cal_session.active = false;
+    
+    ret = settings_subsys_init();
+    if (ret != 0) {
+        return ret;
+    }
+    
+    ret = settings_register(&adc_calibration_handler);
+    if (ret != 0) {
+        return ret;
+    }
+    
+    /* Bad or missing entries just leave the nominal divider in place */
+    settings_load_subtree(ADC_CAL_SETTINGS_ROOT);
+    return 0;
+}
+
+bool adc_calibration_active(void)
+{
+    return adc_cal_session.active;
+}
+
+int adc_calibration_points(void)
+{
+    return adc_cal_session.points;
+}
+
+int adc_calibration_begin(enum adc_input_names_t input_name)
+{
+    if (input_name < 0 || input_name >= adc_input_count) {
+        return -EINVAL;
+    }
+    
+    if (adc_cal_session.active) {
+        adc_calibration_abort();
+    }
+    
+    adc_cal_session.active = true;
+    adc_cal_session.input = input_name;
+    adc_cal_session.previous = adc_inputs[input_name].cal;
+    adc_cal_session.points = 0;
+    
+    adc_set_calibration(input_name, &adc_cal_identity);
+    adc_set_calibrating(input_name, true);
+    return 0;
+}
+
+int adc_calibration_point(uint16_t reference_mv)
+{
+    struct adc_calibration_session_t *session = &adc_cal_session;
+    uint16_t measured_mv;
+    int point = session->points;
+    
+    if (!session->active) {
+        return -EINVAL;
+    }
+    
+    if (point >= ADC_CAL_MAX_POINTS) {
+        return -ENOSPC;
+    }
+    
+    /* Average over a full ring of readings taken since the reference went on */
+    if (!adc_get_settled_mv(session->input, &measured_mv)) {
+        return -EAGAIN;
+    }
+    
+    session->reference_mv[point] = reference_mv;
+    session->measured_mv[point] = measured_mv;
+    session->points++;
+    
+    /* The next point needs its own full set of readings */
+    adc_set_calibrating(session->input, true);
+    return 0;
+}
+
+int adc_calibration_commit(void)
+{
+    struct adc_calibration_session_t *session = &adc_cal_session;
+    struct adc_calibration_t cal;
+    char key[32];
+    int32_t reference_span;
+    int32_t measured_span;
+    int ret;
+    
+    if (!session->active || !session->points) {
+        return -EINVAL;
+    }
+    
+    /* Done once, so the divides here are fine */
+    if (session->points == 1) {
+        if (!session->measured_mv[0]) {
+            return -EINVAL;
+        }
+        
+        cal.gain_q16 = ((uint32_t)session->reference_mv[0] << 16) /
+                       session->measured_mv[0];
+        cal.offset_mv = 0;
+    } else {
+        reference_span = session->reference_mv[1] - session->reference_mv[0];
+        measured_span = session->measured_mv[1] - session->measured_mv[0];
+        if (!measured_span || (reference_span < 0) != (measured_span < 0)) {
+            return -EINVAL;
+        }
+        
+        cal.gain_q16 = ((int64_t)reference_span << 16) / measured_span;
+        cal.offset_mv = session->reference_mv[0] -
+                        (int32_t)(((int64_t)session->measured_mv[0] *
+                                   cal.gain_q16) >> 16);
+    }
+    
+    if (!adc_calibration_valid(&cal)) {
+        return -ERANGE;
+    }
+    
+    snprintf(key, sizeof(key), ADC_CAL_SETTINGS_ROOT "/"
+             ADC_CAL_SETTINGS_SUBTREE "/%s", adc_inputs[session->input].name);
+    ret = settings_save_one(key, &cal, sizeof(cal));
+    if (ret != 0) {
+        return ret;
+    }
+    
+    adc_set_calibration(session->input, &cal);
+    adc_set_calibrating(session->input, false);
+    session->active = false;
+    return 0;
+}
+
+void adc_calibration_abort(void)
+{
+    struct adc_calibration_session_t *session = &adc_cal_session;
+    
+    if (!session->active) {
+        return;
+    }
+    
+    adc_set_calibration(session->input, &session->previous);
+    adc_set_calibrating(session->input, false);
+    session->active = false;
+}
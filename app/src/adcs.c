@@ -8,20 +8,29 @@
 #include <device.h>
 #include <devicetree.h>
 #include <drivers/adc.h>
+#include <drivers/i2c.h>
 #include <kernel.h>
 
 #include "app-devices.h"
 #include "app-utils.h"
 #include "app-adcs.h"
+#include "app-i2c-sched.h"
 
 #define ADC_INST(x)     adc[x] = device_get_binding(DT_LABEL(DT_NODELABEL(adc##x)))
+#define ADC_ADDR(x)     DT_REG_ADDR(DT_NODELABEL(adc##x))
 
 const struct device *adc[ADC_COUNT];
 
+static const uint16_t adc_addr[ADC_COUNT] = {
+    FOR_EACH(ADC_ADDR, (,), 0, 1, 2, 3, 4, 5)
+};
+
 
 #define ADC_ENTRY(label, dev, channel, reference_mv)                        \
     {#label, 0x0000, 0x0000, reference_mv, (struct device **)(&dev),        \
-        {ADC_GAIN_1, ADC_REF_INTERNAL, ADC_ACQ_TIME_DEFAULT, channel, 1,}},
+        {ADC_GAIN_1, ADC_REF_INTERNAL, ADC_ACQ_TIME_DEFAULT, channel, 1,}, 0,  \
+        false, 0, ADC_RESOLUTION_PRECISE, 0, true, 0, {}, false,           \
+        {ADC_CAL_GAIN_ONE, 0}, (uint32_t)(reference_mv) << 16},
 
 
 FOR_ALL_ADCS(struct adc_inputs_t adc_inputs[] = {, ADC_ENTRY, };)
@@ -31,58 +40,497 @@ uint16_t adc_input_count = NELEMENTS(adc_inputs);
 
 
 struct adc_work_t {
-    const struct device *dev;
-    struct k_delayed_work worker;
+    uint16_t addr;
     uint8_t channel_mask;
-    enum adc_input_names_t inputs[4];
-    struct adc_sequence sequence;
-    uint16_t buffer[4];
+    enum adc_input_names_t inputs[MCP342X_CHANNEL_COUNT];
+    uint8_t due_mask;
+    int channel;
+    uint8_t resolution;
+    bool pending;       /* configured for a channel, for the next latch */
+    bool collected;     /* this step's result is in, or there wasn't one */
+};
+
+static struct adc_work_t adc_worker[ADC_COUNT];
+
+static const enum adc_gain adc_pga_gain[ADC_PGA_SHIFT_MAX + 1] = {
+    ADC_GAIN_1, ADC_GAIN_2, ADC_GAIN_4, ADC_GAIN_8,
 };
 
-struct adc_work_t adc_worker[ADC_COUNT];
-
-static void adc_read_worker(struct k_work *work)
-{
-	struct adc_work_t * adc_worker = CONTAINER_OF(
-		work, struct adc_work_t, worker);
-
-    const struct device *dev = adc_worker->dev;
-    struct adc_sequence *seq = &adc_worker->sequence;
-    uint8_t channel_mask = adc_worker->channel_mask;
-    uint16_t *buffer = adc_worker->buffer;
-    size_t buflen = sizeof(adc_worker->buffer);
-    enum adc_input_names_t input_name;
-    struct adc_inputs_t *adc_input;
-    uint32_t value;
-    
-    seq->options = NULL;
-    seq->channels = channel_mask;
-    seq->buffer = buffer;
-    seq->buffer_size = buflen;
-    seq->resolution = 16;
-    seq->oversampling = 0;
-    seq->calibrate = false;
-    
-    int ret = adc_read(dev, (const struct adc_sequence *)seq);
-    if (ret == 0) {
-        for(int i = 0; i < 4; i++) {
-            if ((channel_mask & BIT(i)) != 0x00) {
-                input_name = adc_worker->inputs[i];
-                adc_input = &adc_inputs[input_name];
-                value = buffer[i];
-                adc_input->raw_value = value;
-                ret = adc_raw_to_millivolts(adc_input->reference_mv,
-                        adc_input->config.gain, 16, &value);
-                if (ret != 0) {
-                    value = 0x0000;
-                }
-                adc_input->value_mv = value;
+
+/*
+ * All six converters are sampled together.  Each round starts with working
+ * out which inputs are due, and setting each chip up for its first due
+ * channel.  A single general call then latches them all at once, each chip's
+ * result is collected as it becomes ready, and the chip is immediately set up
+ * for its next due channel, so the next step only needs the general call.
+ * Every reading in a step is from the same instant.
+ */
+static struct k_delayed_work adc_sample_worker;
+static bool adc_latched;
+static uint32_t adc_latch_time;
+static uint32_t adc_round_start;
+
+/*
+ * Calibration changes come from other threads, and restart the filters, so
+ * they can't land halfway through the sampler storing a reading.
+ */
+static K_MUTEX_DEFINE(adc_cal_mutex);
+
+
+static uint8_t adc_pick_resolution(enum adc_input_names_t input_name)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    uint32_t age = k_uptime_get_32() - adc_input->precise_timestamp;
+    
+    if (adc_input->active && !adc_input->calibrating &&
+        age < ADC_PRECISION_INTERVAL_MS) {
+        return ADC_RESOLUTION_FAST;
+    }
+    
+    return ADC_RESOLUTION_PRECISE;
+}
+
+static uint32_t adc_conversion_ms(uint8_t resolution)
+{
+    switch (resolution) {
+        case 12:
+            return ADC_CONVERSION_12BIT_MS;
+        case 14:
+            return ADC_CONVERSION_14BIT_MS;
+        default:
+            return ADC_CONVERSION_16BIT_MS;
+    }
+}
+
+static uint8_t adc_config_byte(enum adc_input_names_t input_name,
+                               uint8_t resolution)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    
+    return MCP342X_CFG_CHANNEL(adc_input->config.channel_id) |
+           MCP342X_CFG_RATE(resolution) |
+           MCP342X_CFG_GAIN(adc_input->pga_shift);
+}
+
+/* Set the chip up for its next due channel, if it has one */
+static int adc_configure(struct adc_work_t *worker)
+{
+    uint8_t config;
+    int ret;
+    
+    worker->pending = false;
+    
+    if (!worker->due_mask) {
+        return 0;
+    }
+    
+    worker->channel = find_lsb_set(worker->due_mask) - 1;
+    worker->due_mask &= ~BIT(worker->channel);
+    worker->resolution = adc_pick_resolution(worker->inputs[worker->channel]);
+    config = adc_config_byte(worker->inputs[worker->channel],
+                             worker->resolution);
+    
+    i2c_sched_begin(I2C_PRIO_ADC, worker->addr);
+    ret = i2c_write(i2c, &config, 1, worker->addr);
+    i2c_sched_end(1);
+    
+    worker->pending = (ret == 0);
+    return ret;
+}
+
+static int adc_convert_all(void)
+{
+    uint8_t command = MCP342X_GENERAL_CALL_CONVERT;
+    int ret;
+    
+    i2c_sched_begin(I2C_PRIO_ADC, MCP342X_GENERAL_CALL_ADDR);
+    ret = i2c_write(i2c, &command, 1, MCP342X_GENERAL_CALL_ADDR);
+    i2c_sched_end(1);
+    
+    return ret;
+}
+
+/*
+ * Inputs that matter to a running bank are sampled every round.  Idle ones
+ * only need to notice a battery going in, unless they are moving quickly.
+ */
+static void adc_update_interval(struct adc_inputs_t *adc_input,
+                                uint16_t previous_mv, uint32_t elapsed)
+{
+    uint32_t delta = _abs((int32_t)adc_input->value_mv - (int32_t)previous_mv);
+    bool moving = delta * 1000 >= ADC_FAST_DVDT_MV_PER_SEC * elapsed;
+    
+    if (adc_input->active || adc_input->calibrating || moving) {
+        adc_input->interval_ms = ADC_INTERVAL_ACTIVE_MS;
+    } else {
+        adc_input->interval_ms = ADC_INTERVAL_IDLE_MS;
+    }
+}
+
+static void adc_set_pga(struct adc_inputs_t *adc_input, uint8_t pga_shift)
+{
+    adc_input->pga_shift = pga_shift;
+    adc_input->config.gain = adc_pga_gain[pga_shift];
+}
+
+/*
+ * Pick the gain for the next reading from this one.  A clipped reading says
+ * nothing about where the input really is, so it is dropped, and the input
+ * is read again at x1 on the next round.  Returns false for a dropped reading.
+ */
+static bool adc_auto_range(struct adc_inputs_t *adc_input, uint16_t raw)
+{
+    if (!adc_input->auto_range) {
+        return true;
+    }
+    
+    if (raw >= ADC_RANGE_CLIPPED_RAW && adc_input->pga_shift) {
+        adc_set_pga(adc_input, 0);
+        adc_input->interval_ms = 0;
+        return false;
+    }
+    
+    if (raw > ADC_RANGE_DOWN_RAW && adc_input->pga_shift) {
+        adc_set_pga(adc_input, adc_input->pga_shift - 1);
+    } else if (raw < ADC_RANGE_UP_RAW &&
+               adc_input->pga_shift < ADC_PGA_SHIFT_MAX) {
+        adc_set_pga(adc_input, adc_input->pga_shift + 1);
+    }
+    
+    return true;
+}
+
+static void adc_history_seed(struct adc_history_t *history, uint16_t value)
+{
+    for (int i = 0; i < ADC_HISTORY_SIZE; i++) {
+        history->samples[i] = value;
+    }
+    
+    history->head = 0;
+    history->count = 1;
+    history->sum = (uint32_t)value << ADC_HISTORY_SHIFT;
+    history->iir_q8 = (int32_t)value << ADC_IIR_FRAC_BITS;
+    history->min_mv = value;
+    history->max_mv = value;
+    history->seeded = true;
+}
+
+/* Only needed when the sample going out of the ring was an extreme */
+static void adc_history_rescan(struct adc_history_t *history)
+{
+    uint16_t min_mv = UINT16_MAX;
+    uint16_t max_mv = 0;
+    
+    for (int i = 0; i < ADC_HISTORY_SIZE; i++) {
+        min_mv = min(min_mv, history->samples[i]);
+        max_mv = max(max_mv, history->samples[i]);
+    }
+    
+    history->min_mv = min_mv;
+    history->max_mv = max_mv;
+}
+
+static void adc_history_add(struct adc_history_t *history, uint16_t value)
+{
+    int32_t target = (int32_t)value << ADC_IIR_FRAC_BITS;
+    uint16_t filtered = history->iir_q8 >> ADC_IIR_FRAC_BITS;
+    uint16_t evicted;
+    
+    if (!history->seeded || _abs((int32_t)value - filtered) > ADC_FILTER_RESET_MV) {
+        adc_history_seed(history, value);
+    } else {
+        evicted = history->samples[history->head];
+        history->sum -= evicted;
+        history->sum += value;
+        history->samples[history->head] = value;
+        history->head = (history->head + 1) & (ADC_HISTORY_SIZE - 1);
+        history->iir_q8 += (target - history->iir_q8) >> ADC_IIR_SHIFT;
+        history->count = min(history->count + 1, ADC_HISTORY_SIZE);
+        
+        /*
+         * The extremes are kept running.  Only when the one going out was
+         * the min or max, and the new one doesn't take its place, does the
+         * ring need looking through again.
+         */
+        if ((evicted == history->min_mv && value > evicted) ||
+            (evicted == history->max_mv && value < evicted)) {
+            adc_history_rescan(history);
+        } else {
+            history->min_mv = min(history->min_mv, value);
+            history->max_mv = max(history->max_mv, value);
+        }
+    }
+    
+    /* Round the Q8 state to the nearest mV */
+    history->filtered_mv = (history->iir_q8 + BIT(ADC_IIR_FRAC_BITS - 1)) >>
+                           ADC_IIR_FRAC_BITS;
+    history->mean_mv = history->sum >> ADC_HISTORY_SHIFT;
+}
+
+static void adc_store(enum adc_input_names_t input_name, int16_t raw,
+                      uint8_t resolution, uint32_t timestamp)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    uint16_t previous_mv = adc_input->value_mv;
+    uint32_t elapsed = timestamp - adc_input->timestamp;
+    uint8_t pga_shift = adc_input->pga_shift;
+    int32_t value;
+    int32_t value_mv;
+    uint16_t raw_value;
+    
+    /*
+     * Single ended, so the full scale of 2.048V / gain is at
+     * 2^(resolution - 1) counts.  The divider in front of the pin is folded
+     * into reference_mv, and from there into scale_q16.  raw_value is kept
+     * at 16 bit scale, whatever the resolution.
+     */
+    value = max((int32_t)raw, 0);
+    raw_value = value << (ADC_RESOLUTION_PRECISE - resolution);
+    
+    if (!adc_auto_range(adc_input, raw_value)) {
+        return;
+    }
+    
+    k_mutex_lock(&adc_cal_mutex, K_FOREVER);
+    
+    /* scale_q16 is the divider with the calibrated gain already folded in */
+    value_mv = ((uint64_t)value * adc_input->scale_q16) >>
+               (16 + resolution - 1 + pga_shift);
+    value_mv += adc_input->cal.offset_mv;
+    
+    adc_input->raw_value = raw_value;
+    adc_input->value_mv = clamp(value_mv, 0, UINT16_MAX);
+    adc_input->resolution = resolution;
+    adc_input->timestamp = timestamp;
+    adc_history_add(&adc_input->history, adc_input->value_mv);
+    
+    if (resolution == ADC_RESOLUTION_PRECISE) {
+        adc_input->precise_timestamp = timestamp;
+    }
+    
+    adc_update_interval(adc_input, previous_mv, elapsed);
+    
+    k_mutex_unlock(&adc_cal_mutex);
+}
+
+/* Returns true once this chip's result is in */
+static bool adc_collect(struct adc_work_t *worker)
+{
+    uint8_t buffer[3];
+    int ret;
+    
+    i2c_sched_begin(I2C_PRIO_ADC, worker->addr);
+    ret = i2c_read(i2c, buffer, sizeof(buffer), worker->addr);
+    i2c_sched_end(sizeof(buffer));
+    
+    if (ret != 0) {
+        /* Drop the rest of this chip's round, try again next round */
+        worker->pending = false;
+        worker->collected = true;
+        worker->due_mask = 0;
+        return true;
+    }
+    
+    if ((buffer[2] & MCP342X_CFG_RDY) != 0) {
+        return false;
+    }
+    
+    adc_store(worker->inputs[worker->channel],
+              (int16_t)((buffer[0] << 8) | buffer[1]), worker->resolution,
+              adc_latch_time);
+    worker->collected = true;
+    
+    /*
+     * Pipeline the channel switch while the others finish.  That leaves it
+     * pending again, but collected keeps it from being read until the next
+     * latch has actually started a conversion.
+     */
+    adc_configure(worker);
+    return true;
+}
+
+/* Returns how long the step takes, or 0 if there is nothing to convert */
+static uint32_t adc_start_step(void)
+{
+    uint32_t wait_ms = 0;
+    
+    for (int i = 0; i < ADC_COUNT; i++) {
+        struct adc_work_t *worker = &adc_worker[i];
+        
+        worker->collected = !worker->pending;
+        if (worker->pending) {
+            wait_ms = max(wait_ms, adc_conversion_ms(worker->resolution));
+        }
+    }
+    
+    if (!wait_ms) {
+        return 0;
+    }
+    
+    adc_latch_time = k_uptime_get_32();
+    if (adc_convert_all() != 0) {
+        return 0;
+    }
+    
+    return wait_ms;
+}
+
+static void adc_plan_round(void)
+{
+    uint32_t now = k_uptime_get_32();
+    
+    for (int i = 0; i < ADC_COUNT; i++) {
+        struct adc_work_t *worker = &adc_worker[i];
+        
+        worker->due_mask = 0;
+        for (int j = 0; j < MCP342X_CHANNEL_COUNT; j++) {
+            if ((worker->channel_mask & BIT(j)) == 0) {
+                continue;
+            }
+            
+            struct adc_inputs_t *adc_input = &adc_inputs[worker->inputs[j]];
+            uint32_t age = now - adc_input->timestamp + ADC_DUE_SLACK_MS;
+            
+            if (age >= adc_input->interval_ms) {
+                worker->due_mask |= BIT(j);
             }
-        }        
+        }
+        
+        adc_configure(worker);
     }
+}
 
-    /* Schedule yourself for 1s out */
-    k_delayed_work_submit((struct k_delayed_work *)work, K_MSEC(1000));
+static void adc_next_round(void)
+{
+    uint32_t now = k_uptime_get_32();
+    uint32_t elapsed = now - adc_round_start;
+    
+    if (elapsed >= ADC_ROUND_PERIOD_MS) {
+        adc_round_start = now;
+        k_delayed_work_submit(&adc_sample_worker, K_NO_WAIT);
+    } else {
+        adc_round_start += ADC_ROUND_PERIOD_MS;
+        k_delayed_work_submit(&adc_sample_worker,
+                              K_MSEC(ADC_ROUND_PERIOD_MS - elapsed));
+    }
+}
+
+static void adc_sample_worker_fn(struct k_work *work)
+{
+    bool done = true;
+    uint32_t wait_ms;
+    
+    ARG_UNUSED(work);
+    
+    if (adc_latched) {
+        for (int i = 0; i < ADC_COUNT; i++) {
+            struct adc_work_t *worker = &adc_worker[i];
+            
+            if (!worker->collected) {
+                done &= adc_collect(worker);
+            }
+        }
+        
+        if (!done) {
+            k_delayed_work_submit(&adc_sample_worker, K_MSEC(ADC_POLL_MS));
+            return;
+        }
+        
+        adc_latched = false;
+    } else {
+        adc_plan_round();
+    }
+    
+    wait_ms = adc_start_step();
+    if (wait_ms) {
+        adc_latched = true;
+        k_delayed_work_submit(&adc_sample_worker, K_MSEC(wait_ms));
+        return;
+    }
+    
+    adc_next_round();
+}
+
+
+void adc_set_active(enum adc_input_names_t input_name, bool active)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    
+    adc_input->active = active;
+    if (active) {
+        /* Don't wait out the idle interval */
+        adc_input->interval_ms = ADC_INTERVAL_ACTIVE_MS;
+    }
+}
+
+void adc_set_auto_range(enum adc_input_names_t input_name, bool auto_range)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    
+    adc_input->auto_range = auto_range;
+    if (!auto_range) {
+        adc_set_pga(adc_input, 0);
+    }
+}
+
+void adc_set_calibration(enum adc_input_names_t input_name,
+                         const struct adc_calibration_t *cal)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    
+    k_mutex_lock(&adc_cal_mutex, K_FOREVER);
+    adc_input->cal = *cal;
+    adc_input->scale_q16 = adc_input->reference_mv * cal->gain_q16;
+    
+    /* Don't average the old scale in with the new */
+    adc_input->history.seeded = false;
+    k_mutex_unlock(&adc_cal_mutex);
+}
+
+/* Calibration wants 16 bit readings, and plenty of them */
+void adc_set_calibrating(enum adc_input_names_t input_name, bool calibrating)
+{
+    struct adc_inputs_t *adc_input = &adc_inputs[input_name];
+    
+    k_mutex_lock(&adc_cal_mutex, K_FOREVER);
+    adc_input->calibrating = calibrating;
+    adc_input->interval_ms = ADC_INTERVAL_ACTIVE_MS;
+    adc_input->history.seeded = false;
+    k_mutex_unlock(&adc_cal_mutex);
+}
+
+/* The mean of a full ring of readings since the filters last restarted */
+bool adc_get_settled_mv(enum adc_input_names_t input_name, uint16_t *mean_mv)
+{
+    struct adc_history_t *history = &adc_inputs[input_name].history;
+    bool settled;
+    
+    k_mutex_lock(&adc_cal_mutex, K_FOREVER);
+    settled = history->seeded && history->count >= ADC_HISTORY_SIZE;
+    *mean_mv = history->mean_mv;
+    k_mutex_unlock(&adc_cal_mutex);
+    
+    return settled;
+}
+
+uint16_t adc_get_filtered_mv(enum adc_input_names_t input_name)
+{
+    return adc_inputs[input_name].history.filtered_mv;
+}
+
+uint16_t adc_get_mean_mv(enum adc_input_names_t input_name)
+{
+    return adc_inputs[input_name].history.mean_mv;
+}
+
+uint16_t adc_get_min_mv(enum adc_input_names_t input_name)
+{
+    return adc_inputs[input_name].history.min_mv;
+}
+
+uint16_t adc_get_max_mv(enum adc_input_names_t input_name)
+{
+    return adc_inputs[input_name].history.max_mv;
 }
 
 
@@ -94,22 +542,21 @@ int adcs_init(void)
     for (int i = 0; i < ADC_COUNT; i++) {
         struct adc_work_t *worker = &adc_worker[i];
 
-        worker->dev = adc[i];
-    	k_delayed_work_init(&worker->worker, adc_read_worker);
+        worker->addr = adc_addr[i];
     	worker->channel_mask = 0;
+    	worker->due_mask = 0;
+    	worker->pending = false;
+    	worker->collected = true;
     }
     
+	k_delayed_work_init(&adc_sample_worker, adc_sample_worker_fn);
+    
     /* Initialize all ADC channels */
     for (int i = 0; i < adc_input_count; i++) {
         struct adc_inputs_t *adc_input = &adc_inputs[i];
-        int index = *adc_input->pdev - adc[0];
+        int index = (const struct device **)adc_input->pdev - &adc[0];
         int channel = adc_input->config.channel_id;
         
-        int ret = adc_channel_setup(*adc_input->pdev, &adc_input->config);
-        if (ret != 0) {
-            return ret;
-        }
-        
         adc_worker[index].channel_mask |= BIT(channel);
         adc_worker[index].inputs[channel] = (enum adc_input_names_t)i;
     }
@@ -119,7 +566,7 @@ int adcs_init(void)
 
 void adcs_start(void)
 {
-    for (int i = 0; i < ADC_COUNT; i++) {
-        k_delayed_work_submit(&adc_worker[i].worker, K_MSEC(1000));
-    }
-}
\ No newline at end of file
+    adc_latched = false;
+    adc_round_start = k_uptime_get_32();
+    k_delayed_work_submit(&adc_sample_worker, K_NO_WAIT);
+}
@@ -14,37 +14,35 @@
 #include "app-devices.h"
 #include "app-handlers.h"
 #include "app-charge-counters.h"
+#include "app-fixed-point.h"
+#include "app-retained.h"
+
+/* 1000 / 11718, see charge_counter_update() */
+#define CHARGE_MAH_PER_PULSE_Q32    FP_RATIO(1000, 11718, 32)
+
+/*
+ * Energy per pulse = V * (1 / 3.255) J, and 1 mWh = 3.6 J, so
+ * mWh = mV / (1000 * 3.255 * 3.6) = mV / 11718, accumulated in Q32
+ */
+#define CHARGE_MWH_PER_PULSE_MV_Q32 FP_RECIPROCAL(11718, 32)
 
 
 struct charge_counter_t charge_counter[CHARGE_COUNTER_COUNT] = {
-    {0, 0, 0, POL1, INT1, nSD1, {}},
-    {0, 0, 0, POL2, INT2, nSD2, {}},
-    {0, 0, 0, POL3, INT3, nSD3, {}},
-    {0, 0, 0, POL4, INT4, nSD4, {}},
-    {0, 0, 0, POL5, INT5, nSD5, {}},
-    {0, 0, 0, POLO, INTO, nSDO, {}},
+    {0, 0, 0, POL1, INT1, nSD1, {}, 0, 0, false, VOUT1, 0, 0, 0, 0, 0, 0},
+    {0, 0, 0, POL2, INT2, nSD2, {}, 0, 0, false, VOUT2, 0, 0, 0, 0, 0, 0},
+    {0, 0, 0, POL3, INT3, nSD3, {}, 0, 0, false, VOUT3, 0, 0, 0, 0, 0, 0},
+    {0, 0, 0, POL4, INT4, nSD4, {}, 0, 0, false, VOUT4, 0, 0, 0, 0, 0, 0},
+    {0, 0, 0, POL5, INT5, nSD5, {}, 0, 0, false, VOUT5, 0, 0, 0, 0, 0, 0},
+    {0, 0, 0, POLO, INTO, nSDO, {}, 0, 0, false, VOUT, 0, 0, 0, 0, 0, 0},
 };
 
 
-static void charge_update_worker(struct k_work *work)
+/*
+ * Everything is worked out as each pulse comes in, so there is nothing to
+ * poll, and an idle bank costs nothing.
+ */
+void charge_counter_update(struct charge_counter_t *counter)
 {
-	struct charge_counter_t * counter = CONTAINER_OF(
-		work, struct charge_counter_t, worker);
-	bool shutdown;
-	int32_t raw_count;
-	int32_t mAh;
-
-    int ret = read_io_pin(counter->shutdown, &shutdown);
-    if (ret != 0) {
-        goto done;
-    }
-    
-    if (shutdown) {
-        goto done;
-    }
-    
-    raw_count = counter->raw_count;
-    
     /*
      * 1 interrupt = 1/(Gvh * Rsense) Coulombs
      *   Gvh = 32.55 (typ)
@@ -56,52 +54,144 @@ static void charge_update_worker(struct k_work *work)
      *
      * so mAh = coulombs / 3.6
      *        = count / 11.718
+     *
+     * done as a Q32 multiply, exact up to ~2.2M pulses (190Ah)
      */
      
-    mAh = (raw_count * 1000) / 11718;
-    counter->mAh = mAh;
-
-done:
-    /* Schedule yourself for 1s out */
-    k_delayed_work_submit((struct k_delayed_work *)work, K_MSEC(1000));
+    counter->mAh = fp_scale_q32(counter->raw_count, CHARGE_MAH_PER_PULSE_Q32);
+    counter->mWh = counter->energy_q32 >> 32;
 }
 
 
 int charge_counters_init(void)
 {
-        
-    /* Initialize the charge counter workers */
     for (int i = 0; i < CHARGE_COUNTER_COUNT; i++) {
         struct charge_counter_t *counter = &charge_counter[i];
         
-    	k_delayed_work_init(&counter->worker, charge_update_worker);
+        counter->start_time = k_uptime_get();
+        charge_counter_update(counter);
     }
     return 0;
 }
 
 
-void charge_counters_start(void)
+/*
+ * Called from the interrupt thread on both edges of INTx, with the device's
+ * state as captured in INTCAP at the time of the edge, so the polarity is the
+ * one that went with the pulse.  The falling edge is the pulse.  A rising edge
+ * without a falling edge before it means the falling edge was lost somewhere,
+ * and so was a pulse.
+ */
+void handler_charge_counter(enum io_names_t pin_name, uint32_t state,
+                            uint32_t timestamp)
 {
+    struct charge_counter_t *counter = NULL;
+    
     for (int i = 0; i < CHARGE_COUNTER_COUNT; i++) {
-        k_delayed_work_submit(&charge_counter[i].worker, K_MSEC(1000));
+        if (charge_counter[i].interrupt == pin_name) {
+            counter = &charge_counter[i];
+            break;
+        }
+    }
+    
+    if (!counter) {
+        return;
+    }
+    
+    bool active = (state & BIT(io_pins[counter->interrupt].pin)) != 0;
+    bool positive = (state & BIT(io_pins[counter->polarity].pin)) != 0;
+    
+    if (!active) {
+        if (!counter->int_active) {
+            counter->pulses_missed++;
+        }
+        counter->int_active = false;
+        return;
     }
+    
+    counter->int_active = true;
+    
+    struct charge_pulse_t *pulse = 
+        &counter->pulses[counter->pulse_count & (CHARGE_PULSE_RING_SIZE - 1)];
+    pulse->timestamp = timestamp;
+    pulse->positive = positive;
+    counter->pulse_count++;
+    
+    counter->raw_count += (positive ? 1 : -1);
+    
+    /* One divide per pulse, and pulses are a few per second at most */
+    uint32_t interval = timestamp - counter->last_pulse_time;
+    if (counter->pulse_count > 1 && interval) {
+        int32_t current = CHARGE_UA_MS_PER_PULSE / interval;
+        
+        if (!positive) {
+            current = -current;
+        }
+        
+        counter->current_ua = current;
+        counter->current_avg_ua += (current - counter->current_avg_ua) >>
+                                   CHARGE_CURRENT_AVG_SHIFT;
+        counter->last_interval = interval;
+    }
+    counter->last_pulse_time = timestamp;
+    
+    /*
+     * The newest reading of the bank is at most an ADC round (250ms while
+     * the bank is running) older than the pulse.  The unfiltered value is
+     * used, as the filters lag further behind.
+     */
+    int64_t energy = (int64_t)adc_inputs[counter->voltage].value_mv *
+                     CHARGE_MWH_PER_PULSE_MV_Q32;
+    counter->energy_q32 += (positive ? energy : -energy);
+    
+    charge_counter_update(counter);
+    retained_journal_dirty();
 }
 
 
-void handler_charge_counter(enum io_names_t pin_name)
+/* age 0 is the most recent pulse */
+int charge_counter_get_pulse(int index, int age, struct charge_pulse_t *pulse)
 {
-    struct io_pins_t * io_pin = &io_pins[pin_name];
-    int index = *io_pin->pdev - ioexp[0];
-    if (index == 6) {
-        index = 5;
+    if (index < 0 || index >= CHARGE_COUNTER_COUNT) {
+        return -EINVAL;
     }
+    
     struct charge_counter_t *counter = &charge_counter[index];
-    bool polarity;
+    uint32_t count = counter->pulse_count;
     
-    int ret = read_io_pin(counter->polarity, &polarity);
-    if (ret != 0) {
-        return;
+    if (age < 0 || age >= CHARGE_PULSE_RING_SIZE || age >= count) {
+        return -ENOENT;
     }
     
-    counter->raw_count += (polarity ? 1 : -1);
+    *pulse = counter->pulses[(count - 1 - age) & (CHARGE_PULSE_RING_SIZE - 1)];
+    return 0;
+}
+
+/* Both in uA, signed by polarity, see CHARGE_UA_MS_PER_PULSE */
+int charge_counter_get_current(int index, int32_t *current_ua,
+                               int32_t *average_ua)
+{
+    if (index < 0 || index >= CHARGE_COUNTER_COUNT) {
+        return -EINVAL;
+    }
+    
+    struct charge_counter_t *counter = &charge_counter[index];
+    uint32_t elapsed = k_uptime_get_32() - counter->last_pulse_time;
+    int32_t current = counter->current_ua;
+    int32_t average = counter->current_avg_ua;
+    
+    if (counter->pulse_count < 2 || elapsed >= CHARGE_CURRENT_TIMEOUT_MS) {
+        current = 0;
+        average = 0;
+    } else if (elapsed > counter->last_interval) {
+        /* Overdue for a pulse, so it has dropped since the last one */
+        int32_t bound = CHARGE_UA_MS_PER_PULSE / elapsed;
+        
+        current = clamp(current, -bound, bound);
+        average = clamp(average, -bound, bound);
+    }
+    
+    *current_ua = current;
+    *average_ua = average;
+    return 0;
 }
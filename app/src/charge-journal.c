@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <string.h>
+#include <settings/settings.h>
+#include <sys/crc.h>
+#include <soc.h>
+
+#include "app-utils.h"
+#include "app-charge-counters.h"
+#include "app-input-batteries.h"
+#include "app-charge-journal.h"
+#include "app-retained.h"
+#include "app-safety-queue.h"
+
+
+static struct k_delayed_work charge_journal_worker;
+static uint32_t charge_journal_interval_ms = CHARGE_JOURNAL_INTERVAL_MS;
+static uint32_t charge_journal_crc;
+static bool charge_journal_loaded;
+static struct charge_journal_t charge_journal_restored;
+static struct k_work charge_journal_power_fail_worker;
+
+/* The periodic and power fail checkpoints run from different queues */
+static K_MUTEX_DEFINE(charge_journal_mutex);
+
+
+static int charge_journal_set(const char *key, size_t len,
+                              settings_read_cb read_cb, void *cb_arg)
+{
+    const char *next;
+    ssize_t ret;
+    
+    if (!settings_name_steq(key, CHARGE_JOURNAL_SETTINGS_KEY, &next) || next) {
+        return -ENOENT;
+    }
+    
+    /* A record from another layout is no use, start afresh */
+    if (len != sizeof(charge_journal_restored)) {
+        return 0;
+    }
+    
+    ret = read_cb(cb_arg, &charge_journal_restored,
+                  sizeof(charge_journal_restored));
+    if (ret != sizeof(charge_journal_restored)) {
+        return -EIO;
+    }
+    
+    if (charge_journal_restored.version == CHARGE_JOURNAL_VERSION) {
+        charge_journal_loaded = true;
+    }
+    
+    return 0;
+}
+
+static struct settings_handler charge_journal_handler = {
+    .name = CHARGE_JOURNAL_SETTINGS_ROOT,
+    .h_set = charge_journal_set,
+};
+
+
+void charge_journal_snapshot(struct charge_journal_t *journal)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->version = CHARGE_JOURNAL_VERSION;
+    
+    /* Take a consistent snapshot against the pulse handler */
+    k_sched_lock();
+    for (int i = 0; i < CHARGE_COUNTER_COUNT; i++) {
+        struct charge_counter_t *counter = &charge_counter[i];
+        struct charge_journal_counter_t *entry = &journal->counters[i];
+        
+        entry->energy_q32 = counter->energy_q32;
+        entry->raw_count = counter->raw_count;
+        entry->pulse_count = counter->pulse_count;
+        entry->pulses_missed = counter->pulses_missed;
+    }
+    k_sched_unlock();
+    
+    for (int i = 0; i < min(battery_count, CHARGE_JOURNAL_BANK_COUNT); i++) {
+        struct battery_worker_t *battery = &battery_worker[i];
+        struct charge_journal_bank_t *bank = &journal->banks[i];
+        
+        bank->battery_type_index = battery->battery_type_index;
+        bank->enabled = battery->enabled;
+        bank->min_voltage = battery->battery_type.min_voltage;
+        bank->max_voltage = battery->battery_type.max_voltage;
+    }
+}
+
+/*
+ * Counts are added on rather than replaced, as anything counted since boot
+ * is real.  The bank setup only comes back with banks set, for a warm
+ * restart: after a power cycle the cells may well have been swapped, so the
+ * banks start off and PWRGD and the user decide from there.
+ */
+void charge_journal_apply(const struct charge_journal_t *journal, bool banks)
+{
+    k_sched_lock();
+    for (int i = 0; i < CHARGE_COUNTER_COUNT; i++) {
+        struct charge_counter_t *counter = &charge_counter[i];
+        const struct charge_journal_counter_t *entry = &journal->counters[i];
+        
+        counter->energy_q32 += entry->energy_q32;
+        counter->raw_count += entry->raw_count;
+        counter->pulse_count += entry->pulse_count;
+        counter->pulses_missed += entry->pulses_missed;
+        charge_counter_update(counter);
+    }
+    k_sched_unlock();
+    
+    if (!banks) {
+        return;
+    }
+    
+    for (int i = 0; i < min(battery_count, CHARGE_JOURNAL_BANK_COUNT); i++) {
+        const struct charge_journal_bank_t *bank = &journal->banks[i];
+        
+        if (bank->battery_type_index < 0) {
+            continue;
+        }
+        
+        battery_set_type(i, bank->battery_type_index);
+        battery_set_voltage_limits(i, bank->min_voltage, bank->max_voltage);
+        
+        if (bank->enabled) {
+            battery_set_enabled(i, true);
+        }
+    }
+}
+
+int charge_journal_checkpoint(void)
+{
+    struct charge_journal_t journal;
+    uint32_t crc;
+    int ret = 0;
+    
+    k_mutex_lock(&charge_journal_mutex, K_FOREVER);
+    
+    charge_journal_snapshot(&journal);
+    
+    crc = crc32_ieee((const uint8_t *)&journal, sizeof(journal));
+    if (crc != charge_journal_crc) {
+        ret = settings_save_one(CHARGE_JOURNAL_SETTINGS_ROOT "/"
+                                CHARGE_JOURNAL_SETTINGS_KEY,
+                                &journal, sizeof(journal));
+        if (ret == 0) {
+            charge_journal_crc = crc;
+        }
+    }
+    
+    k_mutex_unlock(&charge_journal_mutex);
+    return ret;
+}
+
+static void charge_journal_worker_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    
+    charge_journal_checkpoint();
+    
+    if (charge_journal_interval_ms) {
+        k_delayed_work_submit(&charge_journal_worker,
+                              K_MSEC(charge_journal_interval_ms));
+    }
+}
+
+
+static void charge_journal_power_fail_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    
+    charge_journal_checkpoint();
+}
+
+static void charge_journal_bod33_isr(const void *arg)
+{
+    ARG_UNUSED(arg);
+    
+    SYSCTRL->INTFLAG.reg = SYSCTRL_INTFLAG_BOD33DET;
+    k_work_submit_to_queue(&safety_work_q, &charge_journal_power_fail_worker);
+}
+
+/*
+ * The SAMD21's BOD33 as the power fail warning.  The fuses set it up to
+ * reset; here it is moved up to CHARGE_JOURNAL_BOD33_LEVEL and made to
+ * interrupt instead, which leaves the checkpoint whatever the supply's
+ * hold-up is as the rail falls from there.  The POR still catches the
+ * supply going away for real.  BOD33 has to be off while it is changed.
+ */
+static void charge_journal_bod33_init(void)
+{
+    SYSCTRL->BOD33.reg &= ~SYSCTRL_BOD33_ENABLE;
+    while (!SYSCTRL->PCLKSR.bit.B33SRDY) {
+    }
+    
+    SYSCTRL->BOD33.reg = SYSCTRL_BOD33_LEVEL(CHARGE_JOURNAL_BOD33_LEVEL) |
+                         SYSCTRL_BOD33_ACTION_INTERRUPT | SYSCTRL_BOD33_HYST;
+    SYSCTRL->BOD33.reg |= SYSCTRL_BOD33_ENABLE;
+    while (!SYSCTRL->PCLKSR.bit.B33SRDY) {
+    }
+    
+    SYSCTRL->INTFLAG.reg = SYSCTRL_INTFLAG_BOD33DET;
+    SYSCTRL->INTENSET.reg = SYSCTRL_INTENSET_BOD33DET;
+    
+    IRQ_CONNECT(SYSCTRL_IRQn, 0, charge_journal_bod33_isr, NULL, 0);
+    irq_enable(SYSCTRL_IRQn);
+}
+
+
+int charge_journal_init(void)
+{
+    int ret;
+    
+    k_delayed_work_init(&charge_journal_worker, charge_journal_worker_fn);
+    k_work_init(&charge_journal_power_fail_worker, charge_journal_power_fail_fn);
+    
+    ret = settings_subsys_init();
+    if (ret != 0) {
+        return ret;
+    }
+    
+    ret = settings_register(&charge_journal_handler);
+    if (ret != 0) {
+        return ret;
+    }
+    
+    charge_journal_loaded = false;
+    settings_load_subtree(CHARGE_JOURNAL_SETTINGS_ROOT);
+    
+    /* After a warm restart, retained RAM has newer state than flash */
+    if (charge_journal_loaded && !retained_journal_valid()) {
+        charge_journal_apply(&charge_journal_restored, false);
+    }
+    
+    return 0;
+}
+
+static void charge_journal_schedule(void)
+{
+    if (charge_journal_interval_ms) {
+        k_delayed_work_submit(&charge_journal_worker,
+                              K_MSEC(charge_journal_interval_ms));
+    }
+}
+
+void charge_journal_start(void)
+{
+    /* Only once there is something restored worth saving */
+    charge_journal_bod33_init();
+    charge_journal_schedule();
+}
+
+/* 0 turns the periodic checkpoint off, leaving only explicit ones */
+void charge_journal_set_interval(uint32_t interval_ms)
+{
+    charge_journal_interval_ms = interval_ms;
+    
+    k_delayed_work_cancel(&charge_journal_worker);
+    charge_journal_schedule();
+}
@@ -11,10 +11,22 @@
 #include "app-utils.h"
 #include "app-adcs.h"
 #include "app-charger.h"
+#include "app-fixed-point.h"
+#include "app-retained.h"
+
+/* The output cell is a single LiIon */
+#define CHARGER_MIN_MV  3000
+#define CHARGER_MAX_MV  4200
 
 
 int charger_init(void) {
-    write_io_pin(nSDO, true);
+    bool shutdown = true;
+    
+    /* A warm restart keeps the charger as it was, see gpios_init() */
+    if (!retained_output(nSDO, &shutdown)) {
+        write_io_pin(nSDO, true);
+    }
+    adc_set_active(VOUT, !shutdown);
     return 0;
 }
 
@@ -38,24 +50,21 @@ void handler_charger(enum io_names_t pin_name)
     
     shutdown = standby || !charge;
 
+    io_transaction_begin();
     write_io_pin(LEDOg, charge);
     write_io_pin(LEDOr, standby);
     charger_set_enabled(!shutdown);
+    io_transaction_commit();
 }
 
 uint8_t approximate_output_battery_level(void)
 {
-	uint16_t min_voltage = 3000;
-	uint16_t max_voltage = 4200;
 	uint16_t current_voltage;
-	uint16_t temp;
 	
-	current_voltage = clamp(adc_inputs[VOUT].value_mv, min_voltage, max_voltage);
+	current_voltage = clamp(adc_get_mean_mv(VOUT), CHARGER_MIN_MV, CHARGER_MAX_MV);
 
-	temp = (current_voltage - min_voltage) * 100;
-	temp /= (max_voltage - min_voltage);
-	
-	return temp;
+	return fp_percent(current_voltage - CHARGER_MIN_MV,
+	                  FP_PERCENT_RECIPROCAL(CHARGER_MAX_MV - CHARGER_MIN_MV));
 }
 
 bool charger_enabled(void)
@@ -72,6 +81,10 @@ bool charger_enabled(void)
 
 void charger_set_enabled(bool enabled)
 {
+    io_transaction_begin();
     write_io_pin(nSDO, !enabled);
     write_io_pin(LEDActive, enabled);
+    io_transaction_commit();
+    
+    adc_set_active(VOUT, enabled);
 }
@@ -9,7 +9,6 @@
 #include <devicetree.h>
 #include <kernel.h>
 #include <adafruit-gfx-api.h>
-#include <stdio.h>
 #include <string.h>
 
 #include "app-display.h"
@@ -18,7 +17,12 @@
 #include "app-input-batteries.h"
 #include "app-charger.h"
 #include "app-charge-counters.h"
+#include "app-adc-calibration.h"
 #include "app-utils.h"
+#include "app-i2c-sched.h"
+#include "app-i2c-stats.h"
+#include "app-fixed-point.h"
+#include "app-format.h"
 
 
 const struct device *display;
@@ -35,6 +39,16 @@ void battery_settings_menu_next(int index);
 void battery_settings_choice_prev(int index);
 void battery_settings_choice_next(int index);
 
+void calibration_menu_prev(int index);
+void calibration_menu_next(int index);
+void calibration_choice_prev(int index);
+void calibration_choice_next(int index);
+void calibration_menu_select(int index);
+void calibration_menu_abort(int index);
+
+void bus_menu_prev(int index);
+void bus_menu_next(int index);
+
 
 uint8_t *battery_print_label(int index);
 uint8_t *battery_print_enabled(int index);
@@ -43,6 +57,23 @@ uint8_t *battery_print_voltage(int index);
 uint8_t *battery_print_min_voltage(int index);
 uint8_t *battery_print_max_voltage(int index);
 uint8_t *battery_print_charge(int index);
+uint8_t *battery_print_current(int index);
+
+uint8_t *calibration_print_reference(int index);
+uint8_t *calibration_print_point(int index);
+uint8_t *calibration_print_save(int index);
+uint8_t *calibration_print_status(int index);
+
+uint8_t *bus_print_device(int index);
+uint8_t *bus_print_busy_second(int index);
+uint8_t *bus_print_busy_minute(int index);
+uint8_t *bus_print_transactions(int index);
+uint8_t *bus_print_max_latency(int index);
+
+/* Starting point for the reference, and the step the arrows move it by */
+#define CALIBRATION_REFERENCE_MV        1500
+#define CALIBRATION_REFERENCE_STEP_MV   100
+#define CALIBRATION_REFERENCE_MAX_MV    15000
 
 
 /*
@@ -77,6 +108,8 @@ const struct display_item_t battery_item[] = {
     {10, 2, 1, NULL, battery_print_voltage},
     {0, 3, 1, "Charge:", NULL},
     {10, 3, 1, NULL, battery_print_charge},
+    {0, 4, 1, "Current:", NULL},
+    {10, 4, 1, NULL, battery_print_current},
 };
 
 
@@ -97,6 +130,38 @@ const struct display_menu_item_t battery_menu_item[] = {
     {13, 3, 8, 1, battery_print_max_voltage},
 };
 
+const struct display_item_t calibration_item[] = {
+    {0, 0, 1, NULL, battery_print_label},
+    {10, 0, 1, "Calibrate", NULL},
+    {0, 2, 1, "Reference:", NULL},
+    {0, 5, 1, "Voltage:", NULL},
+    {10, 5, 1, NULL, battery_print_voltage},
+    {0, 6, 1, NULL, calibration_print_status},
+};
+
+/*
+ * The whole bus or one device (LEFT/RIGHT), over the last second, and the
+ * last minute for how busy it is
+ */
+const struct display_item_t bus_item[] = {
+    {0, 0, 1, NULL, bus_print_device},
+    {0, 2, 1, "Busy 1s:", NULL},
+    {10, 2, 1, NULL, bus_print_busy_second},
+    {0, 3, 1, "Busy 60s:", NULL},
+    {10, 3, 1, NULL, bus_print_busy_minute},
+    {0, 4, 1, "Xfers 1s:", NULL},
+    {10, 4, 1, NULL, bus_print_transactions},
+    {0, 5, 1, "Max wait:", NULL},
+    {10, 5, 1, NULL, bus_print_max_latency},
+};
+
+/* Apply the reference, set it here, then take one or two points and save */
+const struct display_menu_item_t calibration_menu_item[] = {
+    {13, 2, 8, 1, calibration_print_reference},
+    {0, 3, 10, 1, calibration_print_point},
+    {0, 4, 10, 1, calibration_print_save},
+};
+
 const struct display_menu_t display_menu[] = {
     {
         .display_menu = battery_menu_display,
@@ -112,7 +177,21 @@ const struct display_menu_t display_menu[] = {
         .right = battery_settings_choice_next,
         .down = battery_settings_menu_next,
         .enter = battery_settings_choice_next,
-    }
+    },
+    {
+        .items = calibration_menu_item,
+        .item_count = NELEMENTS(calibration_menu_item),
+        .up = calibration_menu_prev,
+        .left = calibration_choice_prev,
+        .right = calibration_choice_next,
+        .down = calibration_menu_next,
+        .enter = calibration_menu_select,
+        .esc = calibration_menu_abort,
+    },
+    {
+        .left = bus_menu_prev,
+        .right = bus_menu_next,
+    },
 };
 const int menu_count = NELEMENTS(display_menu);
 
@@ -131,7 +210,7 @@ const struct display_page_t display_pages[] = {
     {
         .menu = &display_menu[0],
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 15,
         .index_down = -1,
         .index_right = -1,
         .index_left = -1,
@@ -141,7 +220,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 12,
         .index_right = 3,
@@ -152,7 +231,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 2,
         .index_right = 4,
@@ -163,7 +242,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 3,
         .index_right = 5,
@@ -174,7 +253,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 4,
         .index_right = 6,
@@ -185,7 +264,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 5,
         .index_right = 7,
@@ -196,7 +275,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 6,
         .index_right = 8,
@@ -207,7 +286,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 7,
         .index_right = 9,
@@ -218,7 +297,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 8,
         .index_right = 10,
@@ -229,7 +308,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 9,
         .index_right = 11,
@@ -240,7 +319,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 10,
         .index_right = 12,
@@ -251,7 +330,7 @@ const struct display_page_t display_pages[] = {
         .items = battery_item,
         .item_count = NELEMENTS(battery_item),
         .index_esc = 0,
-        .index_up = -1,
+        .index_up = 14,
         .index_down = -1,
         .index_left = 11,
         .index_right = 2,
@@ -269,14 +348,39 @@ const struct display_page_t display_pages[] = {
         .index_left = -1,
         .index_enter = -1,
     },
+    {       /* 14 */
+        .items = calibration_item,
+        .item_count = NELEMENTS(calibration_item),
+        .menu = &display_menu[2],
+        .index_esc = -1,
+        .index_up = -1,
+        .index_down = -1,
+        .index_right = -1,
+        .index_left = -1,
+        .index_enter = -1,
+    },
+    {       /* 15 */
+        .items = bus_item,
+        .item_count = NELEMENTS(bus_item),
+        .menu = &display_menu[3],
+        .index_esc = 1,
+        .index_up = -1,
+        .index_down = -1,
+        .index_right = -1,
+        .index_left = -1,
+        .index_enter = -1,
+    },
 };
 
 
 struct display_page_t const *current_display_page = NULL;
 int current_index_menu = 0;
 int prev_page = 0;
-uint8_t line_buffer[22];
+uint8_t line_buffer[FORMAT_BUFFER_SIZE];
 struct k_delayed_work display_worker;
+uint16_t calibration_reference_mv = CALIBRATION_REFERENCE_MV;
+int calibration_result;
+int bus_device = -1;
 
 
 int display_init(void)
@@ -381,7 +485,10 @@ static void display_update_worker(struct k_work *work)
         }
     }
 
+    /* The whole framebuffer goes out as one transfer, so it can't be split */
+    i2c_sched_begin(I2C_PRIO_DISPLAY, DT_REG_ADDR(DT_NODELABEL(display)));
     adafruit_gfx_display();
+    i2c_sched_end(I2C_BYTES_DISPLAY_FLUSH);
 
     k_delayed_work_submit((struct k_delayed_work *)work, K_MSEC(5000));
 }
@@ -402,6 +509,8 @@ void handler_button(enum io_names_t pin_name)
         case UP:
             index = current_display_page->index_up;
             if (index != -1) {
+                current_index_menu = current_display_page->index_menu;
+                prev_page = page_index;
                 break;
             }
             if (menu && menu->up) {
@@ -451,6 +560,9 @@ void handler_button(enum io_names_t pin_name)
             if (index != -1) {
                 break;
             }
+            if (menu && menu->esc) {
+                menu->esc(menu_index);
+            }
             index = prev_page;
             break;
         default:
@@ -481,7 +593,7 @@ void draw_battery_level(int battery_index)
         return;
     }
 
-    int filled = ((percentage * 34) + 17) / 100;
+    int filled = fp_div100((percentage * 34) + 17);
     
     adafruit_gfx_drawRect(x0, y0 + 2, 8, 36, WHITE);
     adafruit_gfx_drawRect(x0 + 2, y0, 4, 2, WHITE);
@@ -674,11 +786,7 @@ uint8_t *battery_print_type(int index)
 
 uint8_t *_print_voltage(int mv)
 {
-    int v = mv / 1000;
-    mv = _abs(mv) % 1000;
-    
-    snprintf(line_buffer, 22, "%d.%03d V", v, mv);
-    return line_buffer;
+    return (uint8_t *)format_millivolts((char *)line_buffer, mv);
 }
 
 uint8_t *battery_print_voltage(int index)
@@ -692,17 +800,28 @@ uint8_t *battery_print_voltage(int index)
         input = battery->signal;
     }
     
-    return _print_voltage(adc_inputs[input].value_mv);
+    return _print_voltage(adc_get_filtered_mv(input));
 }
 
 uint8_t *battery_print_charge(int index)
 {
     int counter_index = index / 2;
     struct charge_counter_t *counter = &charge_counter[counter_index];
-    int mAh = counter->mAh;
     
-    snprintf(line_buffer, 22, "%d mAH", mAh);
-    return line_buffer;
+    return (uint8_t *)format_mah((char *)line_buffer, counter->mAh);
+}
+
+/* The averaged figure, the instantaneous one jumps about too much to read */
+uint8_t *battery_print_current(int index)
+{
+    int32_t current_ua;
+    int32_t average_ua;
+    
+    if (charge_counter_get_current(index / 2, &current_ua, &average_ua) != 0) {
+        return NULL;
+    }
+    
+    return (uint8_t *)format_microamps((char *)line_buffer, average_ua);
 }
 
 uint8_t *battery_print_min_voltage(int index)
@@ -814,14 +933,11 @@ void battery_settings_choice_prev(int index)
             } else {
                 struct battery_worker_t *battery = &battery_worker[index];
                 int type_index = battery->battery_type_index + 1;
-                struct battery_type_t *battery_type = &battery->battery_type;
                 uint32_t mask = _ror(battery->battery_choice_bits, type_index);
                 type_index += _find_lsb(mask);
                 type_index %= 32;
                 
-                battery->battery_type_index = type_index;
-                const struct battery_type_t *source = &battery_types[type_index];
-                memcpy(battery_type, source, sizeof(struct battery_type_t));
+                battery_set_type(index, type_index);
             }
             break;
         case 2:     /* battery_print_min_voltage */
@@ -837,7 +953,7 @@ void battery_settings_choice_prev(int index)
                 uint16_t min_voltage = battery_type->min_voltage;
                 uint16_t max_voltage = battery_type->max_voltage;
                 min_voltage = min(max(min_voltage - 100, 0), max_voltage);
-                battery_type->min_voltage = min_voltage;
+                battery_set_voltage_limits(index, min_voltage, max_voltage);
             }
             break;
         case 3:     /* battery_print_max_voltage */
@@ -853,7 +969,7 @@ void battery_settings_choice_prev(int index)
                 uint16_t min_voltage = battery_type->min_voltage;
                 uint16_t max_voltage = battery_type->max_voltage;
                 max_voltage = max(max(max_voltage - 100, 0), min_voltage);
-                battery_type->max_voltage = max_voltage;
+                battery_set_voltage_limits(index, min_voltage, max_voltage);
             }
             break;
         default:
@@ -876,14 +992,11 @@ void battery_settings_choice_next(int index)
                 if (type_index == -1) {
                     type_index = 0;
                 } 
-                struct battery_type_t *battery_type = &battery->battery_type;
                 uint32_t mask = _ror(battery->battery_choice_bits, type_index);
                 type_index += _find_msb(mask);
                 type_index %= 32;
                 
-                battery->battery_type_index = type_index;
-                const struct battery_type_t *source = &battery_types[type_index];
-                memcpy(battery_type, source, sizeof(struct battery_type_t));
+                battery_set_type(index, type_index);
             }
             break;
         case 2:     /* battery_print_min_voltage */
@@ -899,7 +1012,7 @@ void battery_settings_choice_next(int index)
                 uint16_t min_voltage = battery_type->min_voltage;
                 uint16_t max_voltage = battery_type->max_voltage;
                 min_voltage = min(min_voltage + 100, max_voltage);
-                battery_type->min_voltage = min_voltage;
+                battery_set_voltage_limits(index, min_voltage, max_voltage);
             }
             break;
         case 3:     /* battery_print_max_voltage */
@@ -915,10 +1028,211 @@ void battery_settings_choice_next(int index)
                 uint16_t min_voltage = battery_type->min_voltage;
                 uint16_t max_voltage = battery_type->max_voltage;
                 max_voltage = max(max_voltage + 100, min_voltage);
-                battery_type->max_voltage = max_voltage;
+                battery_set_voltage_limits(index, min_voltage, max_voltage);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+static enum adc_input_names_t _calibration_input(int index)
+{
+    if (index == 10) {
+        return VOUT;
+    }
+    
+    return battery_worker[index].signal;
+}
+
+void calibration_menu_prev(int index)
+{
+    struct display_menu_ram_t *menu_ram = &display_menu_ram[index];
+    int count = NELEMENTS(calibration_menu_item);
+    
+    menu_ram->index_current = (menu_ram->index_current + count - 1) % count;
+}
+
+void calibration_menu_next(int index)
+{
+    struct display_menu_ram_t *menu_ram = &display_menu_ram[index];
+    int count = NELEMENTS(calibration_menu_item);
+    
+    menu_ram->index_current = (menu_ram->index_current + 1) % count;
+}
+
+void calibration_choice_prev(int index)
+{
+    if (display_menu_ram[index].index_current != 0) {
+        return;
+    }
+    
+    calibration_reference_mv = max(calibration_reference_mv -
+                                   CALIBRATION_REFERENCE_STEP_MV, 0);
+}
+
+void calibration_choice_next(int index)
+{
+    if (display_menu_ram[index].index_current != 0) {
+        return;
+    }
+    
+    calibration_reference_mv = min(calibration_reference_mv +
+                                   CALIBRATION_REFERENCE_STEP_MV,
+                                   CALIBRATION_REFERENCE_MAX_MV);
+}
+
+void calibration_menu_select(int index)
+{
+    switch (display_menu_ram[index].index_current) {
+        case 0:     /* calibration_print_reference */
+        case 1:     /* calibration_print_point */
+            if (!adc_calibration_active()) {
+                calibration_result = adc_calibration_begin(
+                        _calibration_input(current_index_menu));
+            } else {
+                calibration_result = adc_calibration_point(
+                        calibration_reference_mv);
+            }
+            break;
+        case 2:     /* calibration_print_save */
+            calibration_result = adc_calibration_commit();
+            if (calibration_result == 0) {
+                calibration_result = 1;
             }
             break;
         default:
             break;
     }
 }
+
+void calibration_menu_abort(int index)
+{
+    adc_calibration_abort();
+    calibration_result = 0;
+    display_menu_ram[index].index_current = 0;
+}
+
+uint8_t *calibration_print_reference(int index)
+{
+    return _print_voltage(calibration_reference_mv);
+}
+
+uint8_t *calibration_print_point(int index)
+{
+    if (!adc_calibration_active()) {
+        return "Start";
+    }
+    
+    return "Add point";
+}
+
+uint8_t *calibration_print_save(int index)
+{
+    return "Save";
+}
+
+/* calibration_result is the last call's return, or 1 once saved */
+uint8_t *calibration_print_status(int index)
+{
+    switch (calibration_result) {
+        case 0:
+            break;
+        case 1:
+            return "Saved";
+        case -EAGAIN:
+            return "Settling, try again";
+        case -ENOSPC:
+            return "Points full, save";
+        case -ERANGE:
+            return "Out of range";
+        default:
+            return "Failed";
+    }
+    
+    if (!adc_calibration_active()) {
+        return NULL;
+    }
+    
+    strcpy((char *)line_buffer, "Points: ");
+    line_buffer[8] = '0' + adc_calibration_points();
+    line_buffer[9] = '\0';
+    return line_buffer;
+}
+
+
+void bus_menu_prev(int index)
+{
+    bus_device = max(bus_device - 1, -1);
+}
+
+void bus_menu_next(int index)
+{
+    uint16_t addr;
+    
+    if (i2c_stats_device_addr(bus_device + 1, &addr) == 0) {
+        bus_device++;
+    }
+}
+
+/* bus_device is -1 for the whole bus, or which device in order of first use */
+static void _get_bus_stats(enum i2c_stats_window_name_t window,
+                           struct i2c_stats_window_t *stats)
+{
+    uint16_t addr;
+    
+    if (bus_device < 0 || i2c_stats_device_addr(bus_device, &addr) != 0 ||
+        i2c_stats_get(addr, window, stats) != 0) {
+        i2c_stats_get_total(window, stats);
+    }
+}
+
+uint8_t *bus_print_device(int index)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    uint16_t addr;
+    
+    if (bus_device < 0 || i2c_stats_device_addr(bus_device, &addr) != 0) {
+        return "I2C bus: all";
+    }
+    
+    strcpy((char *)line_buffer, "I2C dev: 0x");
+    line_buffer[11] = hex[(addr >> 4) & 0x0F];
+    line_buffer[12] = hex[addr & 0x0F];
+    line_buffer[13] = '\0';
+    return line_buffer;
+}
+uint8_t *bus_print_busy_second(int index)
+{
+    struct i2c_stats_window_t stats;
+    
+    _get_bus_stats(I2C_STATS_SECOND, &stats);
+    return (uint8_t *)format_microseconds((char *)line_buffer, stats.busy_us);
+}
+
+uint8_t *bus_print_busy_minute(int index)
+{
+    struct i2c_stats_window_t stats;
+    
+    _get_bus_stats(I2C_STATS_MINUTE, &stats);
+    return (uint8_t *)format_microseconds((char *)line_buffer, stats.busy_us);
+}
+
+uint8_t *bus_print_transactions(int index)
+{
+    struct i2c_stats_window_t stats;
+    
+    _get_bus_stats(I2C_STATS_SECOND, &stats);
+    format_fixed((char *)line_buffer, stats.transactions, FORMAT_MS_WIDTH, 0);
+    return line_buffer;
+}
+
+uint8_t *bus_print_max_latency(int index)
+{
+    struct i2c_stats_window_t stats;
+    
+    _get_bus_stats(I2C_STATS_SECOND, &stats);
+    return (uint8_t *)format_microseconds((char *)line_buffer,
+                                          stats.max_latency_us);
+}
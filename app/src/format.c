@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+
+#include "app-utils.h"
+#include "app-format.h"
+
+
+static const uint32_t format_decade[] = {
+    1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1,
+};
+
+#define FORMAT_MAX_DIGITS   NELEMENTS(format_decade)
+
+
+/*
+ * Writes value / 10^decimals, with exactly that many decimal places, right
+ * aligned in width characters.  Returns the length written, not counting
+ * the NUL.
+ */
+int format_fixed(char *buf, int32_t value, int width, int decimals)
+{
+    char digits[FORMAT_MAX_DIGITS];
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    char *p = buf;
+    int first;
+    int len;
+    int i;
+    
+    for (i = 0; i < FORMAT_MAX_DIGITS; i++) {
+        char digit = '0';
+        
+        while (magnitude >= format_decade[i]) {
+            magnitude -= format_decade[i];
+            digit++;
+        }
+        digits[i] = digit;
+    }
+    
+    /* Drop leading zeros, but keep one in front of the decimal point */
+    for (first = 0; first < FORMAT_MAX_DIGITS - decimals - 1; first++) {
+        if (digits[first] != '0') {
+            break;
+        }
+    }
+    
+    len = FORMAT_MAX_DIGITS - first + (decimals ? 1 : 0) + (value < 0 ? 1 : 0);
+    for (i = len; i < width; i++) {
+        *p++ = ' ';
+    }
+    
+    if (value < 0) {
+        *p++ = '-';
+    }
+    
+    for (i = first; i < FORMAT_MAX_DIGITS; i++) {
+        if (i == FORMAT_MAX_DIGITS - decimals) {
+            *p++ = '.';
+        }
+        *p++ = digits[i];
+    }
+    
+    *p = '\0';
+    return p - buf;
+}
+
+char *format_millivolts(char *buf, int32_t mv)
+{
+    int len = format_fixed(buf, mv, FORMAT_VOLTS_WIDTH, 3);
+    
+    strcpy(&buf[len], " V");
+    return buf;
+}
+
+char *format_mah(char *buf, int32_t mAh)
+{
+    int len = format_fixed(buf, mAh, FORMAT_MAH_WIDTH, 0);
+    
+    strcpy(&buf[len], " mAH");
+    return buf;
+}
+
+/* Shown as ms, so a whole second of bus time still fits */
+char *format_microseconds(char *buf, int32_t us)
+{
+    int len = format_fixed(buf, us, FORMAT_MS_WIDTH, 3);
+    
+    strcpy(&buf[len], " ms");
+    return buf;
+}
+
+/* Likewise shown as mA, signed by the direction it flows */
+char *format_microamps(char *buf, int32_t ua)
+{
+    int len = format_fixed(buf, ua, FORMAT_MA_WIDTH, 3);
+    
+    strcpy(&buf[len], " mA");
+    return buf;
+}
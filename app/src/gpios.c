@@ -11,7 +11,9 @@
 #include <kernel.h>
 
 #include "app-gpios.h"
-#include "app-handlers.h"
+#include "app-interrupts.h"
+#include "app-i2c-sched.h"
+#include "app-retained.h"
 #include "app-devices.h"
 #include "app-utils.h"
 
@@ -27,8 +29,8 @@ static void interrupt_handler(const struct device *port,
 
 
 #define IO_ENTRY(label, dev, pin, io_flags, is_active_low, is_interrupt, interrupt_flags)       \
-    {#label, false, (struct device **)(&dev), pin, io_flags, is_active_low, interrupt_flags, {},  \
-     is_interrupt ? interrupt_handler : NULL, 0LL},  
+    {#label, (struct device **)(&dev), pin, io_flags, is_active_low, interrupt_flags, {},  \
+     is_interrupt ? interrupt_handler : NULL},  
 
 
 FOR_ALL_IOS(struct io_pins_t io_pins[] = {, IO_ENTRY, };)
@@ -36,64 +38,188 @@ FOR_ALL_IOS(struct io_pins_t io_pins[] = {, IO_ENTRY, };)
 uint16_t io_count = NELEMENTS(io_pins);
 
 
+#define IO_DEV_ENTRY(label, dev, ios, addr)                                 \
+    {#label, (struct device **)(&dev), addr, IO_FIRST_##label, IO_LAST_##label, \
+     0 ios(IO_PIN_BIT), 0 ios(IO_INPUT_BIT), 0 ios(IO_OUTPUT_BIT),          \
+     0 ios(IO_ACTIVE_LOW_BIT), 0 ios(IO_INTERRUPT_BIT),                    \
+     0 ios(IO_FALLING_BIT), 0 ios(IO_RISING_BIT)},
+
+FOR_ALL_IO_DEVS(const struct io_device_t io_devices[] = {, IO_DEV_ENTRY, };)
+
+
+#define IO_DEV_RANGE(label, ...)                                            \
+    [IO_FIRST_##label ... IO_LAST_##label] = IODEV_##label,
+
+FOR_ALL_IO_DEVS(const uint8_t io_pin_device[] = {, IO_DEV_RANGE, };)
+
+
+/*
+ * Packed state of each device, one bit per pin at the pin's position, always
+ * stored active high.  Inputs come from the last port read, outputs from the
+ * last write.  Only a read (or an interrupt capture) makes the inputs fresh.
+ * The interrupt thread updates the inputs while other threads write the
+ * outputs, so every read-modify-write of value is done with interrupts
+ * locked out.
+ */
+struct io_device_state_t {
+    uint32_t value;
+    uint64_t expiry;
+};
+
+static struct io_device_state_t io_device_state[IODEV_COUNT];
+
+
+/*
+ * Shadow copy of the output latch for each I/O expander.  Writes made inside
+ * a transaction only update the shadow, and every expander with dirty pins
+ * gets a single port write when the outermost transaction is committed.
+ */
+struct ioexp_shadow_t {
+    uint32_t value;
+    uint32_t dirty;
+};
+
+static struct ioexp_shadow_t ioexp_shadow[IODEV_COUNT];
+static K_MUTEX_DEFINE(io_transaction_mutex);
+static int io_transaction_depth;
+
+
+void io_transaction_begin(void)
+{
+    /* The mutex is recursive, so transactions can nest */
+    k_mutex_lock(&io_transaction_mutex, K_FOREVER);
+    io_transaction_depth++;
+}
+
+int io_transaction_commit(void)
+{
+    int ret = 0;
+    
+    if (--io_transaction_depth == 0) {
+        for (int i = IODEV_IOEXP0; i < IODEV_COUNT; i++) {
+            struct ioexp_shadow_t *shadow = &ioexp_shadow[i];
+            
+            if (!shadow->dirty) {
+                continue;
+            }
+            
+            /* Outputs include the nSDx shutdowns, so these go first */
+            i2c_sched_begin(I2C_PRIO_SAFETY, io_devices[i].addr);
+            int err = gpio_port_set_masked_raw(*io_devices[i].pdev,
+                                               shadow->dirty, shadow->value);
+            i2c_sched_end(I2C_BYTES_PORT_WRITE);
+            if (err != 0) {
+                /* Left dirty, so the next commit tries these pins again */
+                if (ret == 0) {
+                    ret = err;
+                }
+                continue;
+            }
+            shadow->dirty = 0;
+        }
+        
+        retained_update();
+    }
+    
+    k_mutex_unlock(&io_transaction_mutex);
+    return ret;
+}
+
 void write_io_pin(enum io_names_t io_name, bool value) {
     struct io_pins_t *io_pin = &io_pins[io_name];
+    int index = io_pin_device[io_name];
+    const struct io_device_t *device = &io_devices[index];
+    struct io_device_state_t *state = &io_device_state[index];
+    uint32_t pin_bit = BIT(io_pin->pin);
     
     if (!IS_OUTPUT(io_name)) {
         /* Not going to try to write an input, are you insane? */
         return;
     }
 
+    io_transaction_begin();
+
     /* value is always stored active high */
-    io_pin->value = value;    
+    unsigned int key = irq_lock();
+    if (value) {
+        state->value |= pin_bit;
+    } else {
+        state->value &= ~pin_bit;
+    }
+    uint32_t current = state->value;
+    irq_unlock(key);
     
-    if (io_pin->is_active_low) {
-        value = !value;
+    if (index == IODEV_PORTA) {
+        /* On-chip port, no bus traffic involved */
+        gpio_pin_set(*device->pdev, io_pin->pin,
+                     (int)(value != io_pin->is_active_low));
+    } else {
+        struct ioexp_shadow_t *shadow = &ioexp_shadow[index];
+        uint32_t raw = current ^ device->active_low_mask;
+        
+        shadow->value = (shadow->value & ~pin_bit) | (raw & pin_bit);
+        shadow->dirty |= pin_bit;
     }
-    gpio_pin_set(*io_pin->pdev, io_pin->pin, (int)value);
-    io_pin->expiry = z_timeout_end_calc(K_MSEC(100));
+
+    io_transaction_commit();
+}
+
+void io_device_update(int index, uint32_t portval)
+{
+    const struct io_device_t *device = &io_devices[index];
+    struct io_device_state_t *state = &io_device_state[index];
+    
+    uint64_t expiry = z_timeout_end_calc(K_MSEC(100));
+    
+    /* Inputs from the port, outputs stay as last written */
+    unsigned int key = irq_lock();
+    state->value = ((portval ^ device->active_low_mask) & device->input_mask) |
+                   (state->value & device->output_mask);
+    state->expiry = expiry;
+    irq_unlock(key);
+}
+
+uint32_t io_device_value(int index)
+{
+    return io_device_state[index].value;
+}
+
+/* Output pins whose last write hasn't reached the device yet */
+uint32_t io_device_pending(int index)
+{
+    return ioexp_shadow[index].dirty;
 }
 
 int read_io_pin(enum io_names_t io_name, bool *outval) {
     struct io_pins_t *io_pin = &io_pins[io_name];
-    const struct device *dev = *io_pins->pdev;
+    int index = io_pin_device[io_name];
+    struct io_device_state_t *state = &io_device_state[index];
     uint32_t portval = 0;
     int ret;
-    bool value;
     
-    /* If this IO has been accessed in the last 100ms, we will not read the port */
-    if (io_pin->expiry < k_uptime_ticks()) {
+    /* If this device's inputs were read in the last 100ms, we will not read the port */
+    unsigned int key = irq_lock();
+    uint64_t expiry = state->expiry;
+    irq_unlock(key);
+    
+    if (expiry < k_uptime_ticks()) {
         /* We read the entire port in one shot */
-        ret = gpio_port_get_raw(dev, &portval);
+        if (index != IODEV_PORTA) {
+            i2c_sched_begin(I2C_PRIO_COUNTER, io_devices[index].addr);
+        }
+        ret = gpio_port_get_raw(*io_devices[index].pdev, &portval);
+        if (index != IODEV_PORTA) {
+            i2c_sched_end(I2C_BYTES_PORT_READ);
+        }
         if (ret != 0) {
             return ret;
         }
     
-        uint64_t expiry = z_timeout_end_calc(K_MSEC(100));
-    
-        /* Find the first item in this device */
-        int curr;
-        for (curr = (int)io_name; curr != 0 && *io_pins[curr].pdev == dev; curr--);
-        
-        if (*io_pins[curr].pdev != dev) {
-            curr++;
-        }
-        
-        /* Now assign the values for every IO in this device from the port reading */
-        for ( ; curr != io_count && *io_pins[curr].pdev == dev; curr++) {
-            io_pin = &io_pins[curr];
-            value = ((portval & BIT(io_pin->pin)) != 0);
-            if (io_pin->is_active_low) {
-                /* We store our values active high */
-                value = !value;
-            }
-            io_pin->value = value;
-            io_pin->expiry = expiry;
-        }
+        io_device_update(index, portval);
     }
     
     /* And return the requested one */
-    *outval = io_pins[io_name].value;
+    *outval = ((state->value & BIT(io_pin->pin)) != 0);
     return 0;
 }
 
@@ -102,29 +228,57 @@ int gpios_init(void)
     porta = device_get_binding(DT_LABEL(DT_NODELABEL(porta)));
     FOR_EACH(IOEXP_INST, (;), 0, 1, 2, 3, 4, 5, 6);
     
-    /* Initialize all IOs */
+    /* Initialize all IOs, with one port write per expander for the outputs */
+    io_transaction_begin();
     for (int i = 0; i < io_count; i++) {
         struct io_pins_t *io_pin = &io_pins[i];
         
-        int ret = gpio_pin_configure(*io_pin->pdev, io_pin->pin, io_pin->io_flags);
+        gpio_flags_t flags = io_pin->io_flags;
+        bool value = false;
+        
+        /*
+         * After a warm restart, outputs come up at the level they were left
+         * at, so running banks are never dropped.  Otherwise they all start
+         * inactive.
+         */
+        if (IS_OUTPUT(i) && retained_output(i, &value)) {
+            flags &= ~(GPIO_OUTPUT_INIT_LOW | GPIO_OUTPUT_INIT_HIGH |
+                       GPIO_OUTPUT_INIT_LOGICAL);
+            flags |= (value != io_pin->is_active_low) ? GPIO_OUTPUT_INIT_HIGH :
+                                                        GPIO_OUTPUT_INIT_LOW;
+        }
+        
+        int ret = gpio_pin_configure(*io_pin->pdev, io_pin->pin, flags);
         if (ret != 0) {
+            io_transaction_commit();
             return ret;
         }
         
         if (IS_OUTPUT(i)) {
-            /* Set all outputs to inactive logic level */
-            write_io_pin(i, false);
+            write_io_pin(i, value);
         }
         
-        if (IS_INPUT(i) && io_pin->handler) {
+        /*
+         * Only the on-chip port takes GPIO callbacks.  The expanders' own
+         * interrupt registers are set up by interrupts_start(), and decoded
+         * from EXT_nINT down through ioexp5.
+         */
+        if (IS_INPUT(i) && io_pin->handler && io_pin_device[i] == IODEV_PORTA) {
         	/* Prepare GPIO callback for interrupt pin */
         	gpio_init_callback(&io_pin->callback,
 			                   io_pin->handler, BIT(io_pin->pin));
         	gpio_add_callback(*io_pin->pdev, &io_pin->callback);
+
+            ret = gpio_pin_interrupt_configure(*io_pin->pdev, io_pin->pin,
+                                               io_pin->interrupt_flags);
+            if (ret != 0) {
+                io_transaction_commit();
+                return ret;
+            }
         }
     }
     
-    return 0;
+    return io_transaction_commit();
 }
 
 
@@ -134,7 +288,6 @@ static void interrupt_handler(const struct device *port,
 {
 	struct io_pins_t * io_pin = CONTAINER_OF(
 		cb, struct io_pins_t, callback);
-    ARG_UNUSED(pins);
     
     if (*io_pin->pdev != port) {
         /* something's boogered */
@@ -142,41 +295,7 @@ static void interrupt_handler(const struct device *port,
     }
 
     int index = io_pin - &io_pins[0];
-    enum io_names_t pin_name = (enum io_names_t)index;
     
-    switch(pin_name) {
-        case INT1:
-        case INT2:
-        case INT3:
-        case INT4:
-        case INT5:
-        case INTO:
-            handler_charge_counter(pin_name);
-            break;
-            
-        case PWRGD1:
-        case PWRGD2:
-        case PWRGD3:
-        case PWRGD4:
-        case PWRGD5:
-            handler_power_good(pin_name);
-            break;
-            
-        case nSTANDBY:
-        case nCHARGE:
-            handler_charger(pin_name);
-            break;
-
-        case UP:
-        case RIGHT:
-        case LEFT:
-        case DOWN:
-        case ENTER:
-        case ESC:
-            handler_button(pin_name);
-            break;
-            
-        default:
-            break;
-    }
+    /* No bus traffic in here, the interrupt thread does the rest */
+    interrupts_post(io_pin_device[index], pins);
 }
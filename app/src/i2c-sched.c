@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <device.h>
+#include <devicetree.h>
+#include <kernel.h>
+
+#include "app-devices.h"
+#include "app-i2c-sched.h"
+#include "app-i2c-stats.h"
+
+/*
+ * Everything hangs off sercom2, so every transaction on it goes between an
+ * i2c_sched_begin() and i2c_sched_end().  Whoever holds the bus runs their own
+ * transfer (DMA driven by the SAM0 I2C driver, so the CPU is free meanwhile),
+ * and when they are done, the bus is handed straight to the oldest waiter in
+ * the highest priority class.
+ *
+ * The classes only compete between threads: work items on the same queue
+ * run one after the other whatever their class.  That is why the PWM and
+ * shutdown work has its own queue (see app-safety-queue.h), apart from the
+ * ADC and display work on the system queue, and the counters are read from
+ * the interrupt thread.  A PWM shutdown then waits behind at most the one
+ * transaction already on the wire.  The longest of those is a display flush,
+ * which the SSD1306 library sends as a single 1KB transfer, about 25ms at
+ * 400kHz.
+ *
+ * begin/end can nest within a thread, the outermost pair is what gets
+ * accounted to the device in the bus statistics.
+ */
+static struct i2c_sched_class_t i2c_sched_class[I2C_PRIO_COUNT];
+static bool i2c_sched_busy;
+static k_tid_t i2c_sched_owner;
+static int i2c_sched_depth;
+static uint16_t i2c_sched_addr;
+static uint32_t i2c_sched_requested;
+static uint32_t i2c_sched_granted;
+
+const struct device *i2c;
+
+
+int i2c_sched_init(void)
+{
+    i2c = device_get_binding(DT_LABEL(DT_NODELABEL(sercom2)));
+    if (!i2c) {
+        return -ENODEV;
+    }
+    
+    for (int i = 0; i < I2C_PRIO_COUNT; i++) {
+        struct i2c_sched_class_t *class = &i2c_sched_class[i];
+        
+        k_sem_init(&class->grant, 0, K_SEM_MAX_LIMIT);
+        class->waiting = 0;
+    }
+    
+    return 0;
+}
+
+
+void i2c_sched_begin(enum i2c_priority_t priority, uint16_t addr)
+{
+    k_tid_t current = k_current_get();
+    uint32_t requested = k_cycle_get_32();
+    unsigned int key = irq_lock();
+    
+    if (i2c_sched_busy && i2c_sched_owner == current) {
+        i2c_sched_depth++;
+        irq_unlock(key);
+        return;
+    }
+    
+    if (i2c_sched_busy) {
+        i2c_sched_class[priority].waiting++;
+        irq_unlock(key);
+    
+        /* i2c_sched_end() leaves the bus busy when it hands it over to us */
+        k_sem_take(&i2c_sched_class[priority].grant, K_FOREVER);
+        
+        key = irq_lock();
+    }
+    
+    i2c_sched_busy = true;
+    i2c_sched_owner = current;
+    i2c_sched_depth = 1;
+    i2c_sched_addr = addr;
+    i2c_sched_requested = requested;
+    i2c_sched_granted = k_cycle_get_32();
+    irq_unlock(key);
+}
+
+
+void i2c_sched_end(size_t bytes)
+{
+    unsigned int key = irq_lock();
+    
+    if (--i2c_sched_depth > 0) {
+        irq_unlock(key);
+        return;
+    }
+    
+    uint32_t now = k_cycle_get_32();
+    uint16_t addr = i2c_sched_addr;
+    uint32_t busy = now - i2c_sched_granted;
+    uint32_t latency = now - i2c_sched_requested;
+    struct k_sem *grant = NULL;
+    
+    i2c_sched_owner = NULL;
+    i2c_sched_busy = false;
+    
+    for (int i = 0; i < I2C_PRIO_COUNT; i++) {
+        struct i2c_sched_class_t *class = &i2c_sched_class[i];
+        
+        if (class->waiting) {
+            /* Handed over still busy, so nobody can slip in before them */
+            class->waiting--;
+            i2c_sched_busy = true;
+            grant = &class->grant;
+            break;
+        }
+    }
+    irq_unlock(key);
+    
+    if (grant) {
+        k_sem_give(grant);
+    }
+    
+    /* The bookkeeping waits until the next transaction is under way */
+    i2c_stats_record(addr, bytes, busy, latency);
+}
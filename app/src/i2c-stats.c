@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <string.h>
+
+#include "app-i2c-stats.h"
+#include "app-utils.h"
+
+/*
+ * Per device bus usage, in rolling 1s and 60s windows.  Each window has a
+ * ring of buckets, indexed by how many bucket lengths into uptime we are.
+ * Rings roll forward lazily, whenever a device is recorded or read, clearing
+ * the buckets that went by without traffic.  This all runs in thread
+ * context, under a mutex rather than with interrupts locked.
+ */
+static struct i2c_stats_t i2c_stats[I2C_STATS_DEVICE_COUNT];
+static int i2c_stats_count;
+static K_MUTEX_DEFINE(i2c_stats_mutex);
+
+struct i2c_stats_ring_t {
+    uint32_t bucket_ms;
+    uint8_t first;
+    uint8_t count;      /* including the one being filled */
+};
+
+static const struct i2c_stats_ring_t i2c_stats_ring[I2C_STATS_WINDOW_COUNT] = {
+    {1000 / I2C_STATS_SECOND_BUCKETS, 0, I2C_STATS_SECOND_BUCKETS + 1},
+    {60000 / I2C_STATS_MINUTE_BUCKETS, I2C_STATS_SECOND_BUCKETS + 1,
+     I2C_STATS_MINUTE_BUCKETS + 1},
+};
+
+
+static struct i2c_stats_bucket_t *i2c_stats_bucket(struct i2c_stats_t *stats,
+                                                   int window, uint32_t period)
+{
+    const struct i2c_stats_ring_t *ring = &i2c_stats_ring[window];
+    
+    return &stats->buckets[ring->first + (period % ring->count)];
+}
+
+static void i2c_stats_roll(struct i2c_stats_t *stats, uint32_t now)
+{
+    for (int i = 0; i < I2C_STATS_WINDOW_COUNT; i++) {
+        const struct i2c_stats_ring_t *ring = &i2c_stats_ring[i];
+        uint32_t period = now / ring->bucket_ms;
+        uint32_t skipped = min(period - stats->period[i], ring->count);
+        
+        /* Every bucket the ring moves onto starts empty */
+        for (uint32_t j = 0; j < skipped; j++) {
+            memset(i2c_stats_bucket(stats, i, period - j), 0,
+                   sizeof(struct i2c_stats_bucket_t));
+        }
+        stats->period[i] = period;
+    }
+}
+
+/* The complete buckets, which is everything but the one being filled */
+static void i2c_stats_sum(struct i2c_stats_t *stats, int window,
+                          struct i2c_stats_window_t *sum)
+{
+    const struct i2c_stats_ring_t *ring = &i2c_stats_ring[window];
+    
+    for (int i = 1; i < ring->count; i++) {
+        struct i2c_stats_bucket_t *bucket =
+            i2c_stats_bucket(stats, window, stats->period[window] - i);
+        
+        sum->transactions += bucket->transactions;
+        sum->bytes += bucket->bytes;
+        sum->busy_us += bucket->busy_us;
+        sum->max_latency_us = max(sum->max_latency_us, bucket->max_latency_us);
+    }
+}
+
+
+static struct i2c_stats_t *i2c_stats_find(uint16_t addr, bool create)
+{
+    for (int i = 0; i < i2c_stats_count; i++) {
+        if (i2c_stats[i].addr == addr) {
+            return &i2c_stats[i];
+        }
+    }
+    
+    if (!create || i2c_stats_count >= I2C_STATS_DEVICE_COUNT) {
+        return NULL;
+    }
+    
+    struct i2c_stats_t *stats = &i2c_stats[i2c_stats_count++];
+    memset(stats, 0, sizeof(struct i2c_stats_t));
+    stats->addr = addr;
+    return stats;
+}
+
+
+/* Called from i2c_sched_end(), once the bus has been handed on */
+void i2c_stats_record(uint16_t addr, size_t bytes, uint32_t busy_cycles,
+                      uint32_t latency_cycles)
+{
+    uint32_t busy_us = k_cyc_to_us_floor32(busy_cycles);
+    uint32_t latency_us = k_cyc_to_us_floor32(latency_cycles);
+    uint32_t now = k_uptime_get_32();
+    
+    k_mutex_lock(&i2c_stats_mutex, K_FOREVER);
+    struct i2c_stats_t *stats = i2c_stats_find(addr, true);
+    
+    if (!stats) {
+        k_mutex_unlock(&i2c_stats_mutex);
+        return;
+    }
+    
+    i2c_stats_roll(stats, now);
+    
+    for (int i = 0; i < I2C_STATS_WINDOW_COUNT; i++) {
+        struct i2c_stats_bucket_t *bucket =
+            i2c_stats_bucket(stats, i, stats->period[i]);
+        
+        if (bucket->transactions < UINT16_MAX) {
+            bucket->transactions++;
+        }
+        bucket->bytes += bytes;
+        bucket->busy_us += busy_us;
+        bucket->max_latency_us = max(bucket->max_latency_us, latency_us);
+    }
+    k_mutex_unlock(&i2c_stats_mutex);
+}
+
+
+int i2c_stats_get(uint16_t addr, enum i2c_stats_window_name_t window,
+                  struct i2c_stats_window_t *stats)
+{
+    if (window < 0 || window >= I2C_STATS_WINDOW_COUNT) {
+        return -EINVAL;
+    }
+    
+    memset(stats, 0, sizeof(struct i2c_stats_window_t));
+    
+    k_mutex_lock(&i2c_stats_mutex, K_FOREVER);
+    struct i2c_stats_t *device = i2c_stats_find(addr, false);
+    
+    if (!device) {
+        k_mutex_unlock(&i2c_stats_mutex);
+        return -ENOENT;
+    }
+    
+    i2c_stats_roll(device, k_uptime_get_32());
+    i2c_stats_sum(device, window, stats);
+    k_mutex_unlock(&i2c_stats_mutex);
+    
+    return 0;
+}
+
+
+/* Devices are numbered in the order they first used the bus */
+int i2c_stats_device_addr(int index, uint16_t *addr)
+{
+    int ret = -ENOENT;
+    
+    k_mutex_lock(&i2c_stats_mutex, K_FOREVER);
+    if (index >= 0 && index < i2c_stats_count) {
+        *addr = i2c_stats[index].addr;
+        ret = 0;
+    }
+    k_mutex_unlock(&i2c_stats_mutex);
+    
+    return ret;
+}
+
+
+/* The whole bus.  busy_us over the window length is the bus utilisation */
+int i2c_stats_get_total(enum i2c_stats_window_name_t window,
+                        struct i2c_stats_window_t *stats)
+{
+    if (window < 0 || window >= I2C_STATS_WINDOW_COUNT) {
+        return -EINVAL;
+    }
+    
+    memset(stats, 0, sizeof(struct i2c_stats_window_t));
+    
+    k_mutex_lock(&i2c_stats_mutex, K_FOREVER);
+    uint32_t now = k_uptime_get_32();
+    
+    for (int i = 0; i < i2c_stats_count; i++) {
+        i2c_stats_roll(&i2c_stats[i], now);
+        i2c_stats_sum(&i2c_stats[i], window, stats);
+    }
+    k_mutex_unlock(&i2c_stats_mutex);
+    
+    return 0;
+}
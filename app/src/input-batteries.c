@@ -9,23 +9,30 @@
 #include <devicetree.h>
 #include <drivers/pwm.h>
 #include <kernel.h>
+#include <string.h>
 
 #include "app-utils.h"
 #include "app-gpios.h"
 #include "app-adcs.h"
 #include "app-handlers.h"
 #include "app-input-batteries.h"
+#include "app-i2c-sched.h"
+#include "app-fixed-point.h"
+#include "app-retained.h"
+#include "app-pwm-frame.h"
+#include "app-safety-queue.h"
 
 const struct device *pwm;
 
-#define BAT_ENTRY(label, select, green, red, shutdown, channel, bat_choice)             \
-    {#label, V##label, select, green, red, shutdown, channel, 0, false, {}, {}, -1, {}, bat_choice},
+#define BAT_ENTRY(label, select, green, red, shutdown, output, channel, bat_choice)     \
+    {#label, V##label, output, select, green, red, shutdown, channel, 0, false, {}, {}, -1, {}, bat_choice},
 
 FOR_ALL_BATS(struct battery_worker_t battery_worker[] = {, BAT_ENTRY, };)
 
 
 #define BAT_TYPE_ENTRY(label, max_voltage, min_voltage)						\
-	{#label, max_voltage, min_voltage},
+	{#label, max_voltage, min_voltage,                                              \
+	    FP_PERCENT_RECIPROCAL((max_voltage) - (min_voltage))},
 
 FOR_ALL_BAT_TYPES(const struct battery_type_t battery_types[] = {, BAT_TYPE_ENTRY, };)
 
@@ -49,8 +56,10 @@ static void battery_led_worker(struct k_work *work)
 	    }
 	}
 	
+	io_transaction_begin();
 	write_io_pin(battery->green, green);
 	write_io_pin(battery->red, red);
+	io_transaction_commit();
 }
 
 
@@ -58,67 +67,190 @@ static void battery_led_worker(struct k_work *work)
 
 static uint16_t current_pwm_mask;
 
-static void battery_pwm_worker(struct k_work *work)
+/* What the PCA9685 is running right now */
+static struct pwm_frame_t current_pwm_frame;
+
+/* Each bank's share of the period, as of the last time it was planned */
+static uint16_t current_pwm_weights[BATTERY_BANK_COUNT];
+
+/* From battery_pwm_set_weights(), for the worker to pick up */
+static uint16_t pending_pwm_weights[BATTERY_BANK_COUNT];
+static bool pwm_weights_pending;
+
+/*
+ * Held off until input_batteries_start(), so nothing reprograms the PCA9685
+ * or the shutdowns from half restored state during a warm restart.
+ */
+static bool battery_pwm_started;
+
+static struct k_delayed_work battery_depletion_worker;
+static void battery_depletion_worker_fn(struct k_work *work);
+
+/*
+ * What a battery can put in, roughly: its voltage, scaled by how full its
+ * type says it is.  A 12V supply outweighs a flat AAA by a few hundred to one.
+ * Fits 16 bits for both batteries of a bank together.
+ */
+static uint16_t battery_pwm_weight(int battery_index)
+{
+	struct battery_worker_t *battery = &battery_worker[battery_index];
+	uint16_t voltage;
+	
+	if (!battery->enabled || !battery->power_good) {
+	    return 0;
+	}
+	
+	voltage = clamp(adc_get_filtered_mv(battery->signal),
+	                battery->battery_type.min_voltage,
+	                battery->battery_type.max_voltage);
+	
+	return (voltage >> 6) * (approximate_battery_level(battery_index) + 1);
+}
+
+static void battery_pwm_weigh(uint16_t pwm_mask, uint16_t *weights)
+{
+	for (int i = 0; i < battery_count; i += 2) {
+	    uint8_t channel = battery_worker[i].channel;
+	    
+	    weights[channel] = 0;
+	    if ((pwm_mask & BIT(channel)) != 0) {
+	        weights[channel] = max(1, battery_pwm_weight(i) +
+	                                  battery_pwm_weight(i + 1));
+	    }
+	}
+}
+
+/*
+ * Running banks get slots in bank order, each PWM_MIN_SLOT plus its weight's
+ * share of what is left, with the rounding going to the last one.  Every
+ * slot keeps its PWM_DEADSPACE guard bands.  The weights are passed in rather
+ * than read here, so a warm restart can rebuild exactly what the PCA9685 is
+ * running.
+ */
+#define PWM_MIN_SLOT    64
+
+static void battery_pwm_plan(uint16_t pwm_mask, const uint16_t *weights,
+                             struct pwm_frame_t *frame)
 {
-	uint16_t pwm_mask = 0;
     uint32_t on_time;
     uint32_t off_time;
+	uint32_t total = 0;
+	uint32_t spare;
+	uint32_t start = 0;
 	int count = 0;
-	uint32_t timeslot = 0;
+	int i;
+	
+	for (i = 0; i < battery_count; i += 2) {
+	    uint8_t channel = battery_worker[i].channel;
+	    
+	    if ((pwm_mask & BIT(channel)) != 0) {
+	        total += weights[channel];
+	        count++;
+	    }
+	}
+	
+	spare = PCA9685_COUNTS - (count * PWM_MIN_SLOT);
+	
+	pwm_frame_clear(frame);
+	for (i = 0; i < battery_count; i += 2) {
+	    uint8_t channel = battery_worker[i].channel;
+	    uint32_t width;
+	    
+	    if ((pwm_mask & BIT(channel)) == 0) {
+	        pwm_frame_set_off(frame, channel);
+	        continue;
+	    }
+	    
+	    width = PWM_MIN_SLOT + ((spare * weights[channel]) / total);
+	    if (--count == 0) {
+	        width = PCA9685_COUNTS - start;
+	    }
+	    
+	    on_time = start + PWM_DEADSPACE;
+	    off_time = start + width - (2 * PWM_DEADSPACE);
+	    pwm_frame_set(frame, channel, on_time, off_time);
+	    start += width;
+	}
+}
+
+static void battery_pwm_worker(struct k_work *work)
+{
+	uint16_t pwm_mask = 0;
+	uint16_t weights[BATTERY_BANK_COUNT];
+	struct pwm_frame_t frame;
 	int i;
 	int ret;
 	
+	if (!battery_pwm_started) {
+	    return;
+	}
+	
 	for (i = 0; i < battery_count; i++) {
 	    struct battery_worker_t * battery = &battery_worker[i];
 	    
 	    if (battery->power_good && battery->enabled) {
 	        pwm_mask |= BIT(battery->channel);
-	        count++;
 	    } else if ((current_pwm_mask & BIT(battery->channel)) != 0) {
 	        /* This was on, and is now off.  Disable it. */
 	        battery->enabled = false;
 	    }
 	    
-	    write_io_pin(battery->shutdown, !(battery->enabled));
+	    adc_set_active(battery->signal, battery->enabled);
 	}
 	
+	/*
+	 * Both batteries in a bank share its shutdown pin, so the bank runs while
+	 * either of them does.  All the shutdown pins go out in one write per
+	 * expander.
+	 */
+	io_transaction_begin();
+	for (i = 0; i < battery_count; i += 2) {
+	    bool running = battery_worker[i].enabled ||
+	            battery_worker[i + 1].enabled;
+	    
+	    write_io_pin(battery_worker[i].shutdown, !running);
+	    adc_set_active(battery_worker[i].output, running);
+	}
+	io_transaction_commit();
+	
+	/*
+	 * New weights only apply to the banks they were worked out for.  If the
+	 * running banks changed, everything gets weighed afresh.
+	 */
 	if (current_pwm_mask == pwm_mask) {
-	    return;
+	    if (!pwm_weights_pending) {
+	        return;
+	    }
+	    memcpy(weights, pending_pwm_weights, sizeof(weights));
+	} else {
+	    battery_pwm_weigh(pwm_mask, weights);
 	}
+	pwm_weights_pending = false;
 	
-	current_pwm_mask = pwm_mask;
+	battery_pwm_plan(pwm_mask, weights, &frame);
 	
-	/* The mask has changed.  Let's go for safety and shut them all off first */
-	ret = pwm_pin_set_cycles(pwm, 0xFF, 4096, 0, PWM_FLAG_START_DELAY);
-    if (ret != 0) {
-        return;
-    }
-
-	if (count) {
-    	timeslot = 4096 / count;
+	ret = pwm_frame_transition(&current_pwm_frame, &frame);
+	if (ret == 0) {
+	    current_pwm_mask = pwm_mask;
+	    memcpy(current_pwm_weights, weights, sizeof(current_pwm_weights));
 	}
 	
-	for (i = 0; i < battery_count / 2; i++) {
-	    if ((pwm_mask & BIT(i)) != 0) {
-	        on_time = PWM_DEADSPACE + (i * timeslot);
-	        off_time = ((i + 1) * timeslot) - (2 * PWM_DEADSPACE);
-	    } else {
-	        on_time = 4096;
-	        off_time = 0;
-	    }
-	    
-	    ret = pwm_pin_set_cycles(pwm, battery_worker[2 * i].channel, on_time,
-	            off_time, PWM_FLAG_START_DELAY);
-	    if (ret != 0) {
-	        return;
-	    }
-	}
+	retained_update();
+	retained_journal_dirty();
 }
 
 
 int input_batteries_init(void)
 {
     pwm = device_get_binding(DT_LABEL(DT_NODELABEL(pwm)));
+    
+    /* The PCA9685 powers up with everything full off */
+    pwm_frame_clear(&current_pwm_frame);
+    
+    int ret = pwm_frame_init();
+    if (ret != 0) {
+        return ret;
+    }
 
     /* Initialize battery workers */
     for (int i = 0; i < battery_count; i++) {
@@ -126,10 +258,20 @@ int input_batteries_init(void)
         k_work_init(&worker->led_worker, battery_led_worker);
         k_work_init(&worker->pwm_worker, battery_pwm_worker);
     }
+    k_delayed_work_init(&battery_depletion_worker, battery_depletion_worker_fn);
 
     return 0;
 }
 
+/* Once the banks' state is restored, if there was any to restore */
+void input_batteries_start(void)
+{
+    battery_pwm_started = true;
+    k_work_submit_to_queue(&safety_work_q, &battery_worker[0].pwm_worker);
+    k_delayed_work_submit_to_queue(&safety_work_q, &battery_depletion_worker,
+                                   K_MSEC(BATTERY_DEPLETION_CHECK_MS));
+}
+
 
 
 static int get_active_battery(const struct device *dev, enum battery_t *battery)
@@ -178,9 +320,10 @@ void handler_power_good(enum io_names_t pin_name)
     if (ret != 0) {
         return;
     }
+    retained_update();
 
     k_work_submit(&worker->led_worker);
-    k_work_submit(&worker->pwm_worker);
+    k_work_submit_to_queue(&safety_work_q, &worker->pwm_worker);
 }
 
 
@@ -194,14 +337,11 @@ uint8_t approximate_battery_level(int battery_index)
 	uint16_t min_voltage = battery->battery_type.min_voltage;
 	uint16_t max_voltage = battery->battery_type.max_voltage;
 	uint16_t current_voltage;
-	uint16_t temp;
 	
-	current_voltage = clamp(adc_inputs[battery->signal].value_mv, min_voltage, max_voltage);
+	current_voltage = clamp(adc_get_mean_mv(battery->signal), min_voltage, max_voltage);
 
-	temp = (current_voltage - min_voltage) * 100;
-	temp /= (max_voltage - min_voltage);
-	
-	return temp;
+	return fp_percent(current_voltage - min_voltage,
+	                  battery->battery_type.percent_reciprocal);
 }
 
 bool battery_enabled(int battery_index)
@@ -215,6 +355,71 @@ bool battery_enabled(int battery_index)
 }
 
 
+/* The percentage reciprocal has to follow any change to the span */
+void battery_set_voltage_limits(int battery_index, uint16_t min_voltage,
+                                uint16_t max_voltage)
+{
+	if (battery_index < 0 || battery_index >= battery_count) {
+		return;
+	}
+
+	struct battery_type_t *battery_type = &battery_worker[battery_index].battery_type;
+	
+	battery_type->min_voltage = min_voltage;
+	battery_type->max_voltage = max_voltage;
+	if (max_voltage > min_voltage) {
+	    battery_type->percent_reciprocal = FP_PERCENT_RECIPROCAL(max_voltage - min_voltage);
+	} else {
+	    battery_type->percent_reciprocal = 0;
+	}
+	
+	retained_journal_dirty();
+}
+
+void battery_set_type(int battery_index, int type_index)
+{
+	if (battery_index < 0 || battery_index >= battery_count ||
+	    type_index < 0 || type_index >= battery_type_count) {
+		return;
+	}
+
+	struct battery_worker_t *battery = &battery_worker[battery_index];
+	
+	battery->battery_type_index = type_index;
+	battery->battery_type = battery_types[type_index];
+	battery->depletion = BATTERY_OK;
+	
+	retained_journal_dirty();
+}
+
+uint16_t battery_pwm_mask(void)
+{
+	return current_pwm_mask;
+}
+
+void battery_pwm_weights(uint16_t *weights)
+{
+	memcpy(weights, current_pwm_weights, sizeof(current_pwm_weights));
+}
+
+/* Replan the running banks' slots with these weights, see battery_pwm_plan() */
+void battery_pwm_set_weights(const uint16_t *weights)
+{
+	memcpy(pending_pwm_weights, weights, sizeof(pending_pwm_weights));
+	pwm_weights_pending = true;
+	k_work_submit_to_queue(&safety_work_q, &battery_worker[0].pwm_worker);
+}
+
+/* Only for a warm restart, where the PCA9685 is still running these phases */
+void battery_pwm_restore(uint16_t pwm_mask, const uint16_t *weights)
+{
+	current_pwm_mask = pwm_mask;
+	memcpy(current_pwm_weights, weights, sizeof(current_pwm_weights));
+	battery_pwm_plan(pwm_mask, current_pwm_weights, &current_pwm_frame);
+	current_pwm_frame.mask = 0;
+}
+
+
 void battery_set_enabled(int battery_index, bool enabled)
 {
 	if (battery_index < 0 || battery_index >= battery_count) {
@@ -229,6 +434,8 @@ void battery_set_enabled(int battery_index, bool enabled)
         return;
     }
 
+	io_transaction_begin();
+
 	/* Can't have both batteries in a bank enabled at the same time */
 	if (active_battery != (enum battery_t)battery_index && enabled) {
 		battery_worker[active_battery].enabled = false;
@@ -236,8 +443,102 @@ void battery_set_enabled(int battery_index, bool enabled)
 	}
 	
 	battery_worker[battery_index].enabled = enabled;
+	battery_worker[battery_index].depletion = BATTERY_OK;
 	write_io_pin(battery_worker[battery_index].select, enabled);
+	io_transaction_commit();
+	retained_journal_dirty();
 
     k_work_submit(&battery_worker[battery_index].led_worker);
-    k_work_submit(&battery_worker[battery_index].pwm_worker);
+    k_work_submit_to_queue(&safety_work_q,
+                           &battery_worker[battery_index].pwm_worker);
+}
+
+static bool battery_depletion_step(struct battery_worker_t *battery,
+                                   uint32_t now)
+{
+	struct adc_inputs_t *adc_input = &adc_inputs[battery->signal];
+	uint16_t min_voltage = battery->battery_type.min_voltage;
+	uint16_t hysteresis = (battery->battery_type.max_voltage - min_voltage) >>
+	                      BATTERY_DEPLETION_HYST_SHIFT;
+	uint16_t voltage = adc_input->history.filtered_mv;
+	
+	/* Not under load, or nothing read yet: hold where it is */
+	if (!battery->enabled || !battery->power_good || !adc_input->history.seeded) {
+	    return false;
+	}
+	
+	switch (battery->depletion) {
+	    case BATTERY_OK:
+	        if (voltage < min_voltage) {
+	            battery->depletion = BATTERY_LOW;
+	            battery->low_since = now;
+	        }
+	        break;
+	        
+	    case BATTERY_LOW:
+	        if (voltage >= min_voltage + hysteresis) {
+	            battery->depletion = BATTERY_OK;
+	        } else if (now - battery->low_since >= BATTERY_DEPLETION_DEBOUNCE_MS) {
+	            battery->depletion = BATTERY_DEPLETED;
+	            return true;
+	        }
+	        break;
+	        
+	    case BATTERY_DEPLETED:
+	        /* Cut off already, until it's enabled again */
+	        break;
+	}
+	
+	return false;
+}
+
+/*
+ * Every battery that ran down since the last check is cut off in one go: one
+ * write per expander for the selects, and one PWM worker run for the
+ * phases, however many went at once.  It runs on the safety queue, so it
+ * never interleaves with the PWM worker.
+ */
+static void battery_check_depletion(void)
+{
+	uint32_t now = k_uptime_get_32();
+	uint16_t depleted = 0;
+	int i;
+	
+	for (i = 0; i < battery_count; i++) {
+	    if (battery_depletion_step(&battery_worker[i], now)) {
+	        depleted |= BIT(i);
+	    }
+	}
+	
+	if (!depleted) {
+	    return;
+	}
+	
+	io_transaction_begin();
+	for (i = 0; i < battery_count; i++) {
+	    if ((depleted & BIT(i)) != 0) {
+	        battery_worker[i].enabled = false;
+	        write_io_pin(battery_worker[i].select, false);
+	    }
+	}
+	io_transaction_commit();
+	
+	for (i = 0; i < battery_count; i++) {
+	    if ((depleted & BIT(i)) != 0) {
+	        k_work_submit(&battery_worker[i].led_worker);
+	    }
+	}
+	
+	/* The worker looks at every battery, so one run covers them all */
+	k_work_submit_to_queue(&safety_work_q,
+	                       &battery_worker[find_lsb_set(depleted) - 1].pwm_worker);
+}
+
+static void battery_depletion_worker_fn(struct k_work *work)
+{
+	battery_check_depletion();
+	
+	k_delayed_work_submit_to_queue(&safety_work_q,
+	                               (struct k_delayed_work *)work,
+	                               K_MSEC(BATTERY_DEPLETION_CHECK_MS));
 }
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <device.h>
+#include <devicetree.h>
+#include <drivers/gpio.h>
+#include <drivers/i2c.h>
+#include <kernel.h>
+
+#include "app-gpios.h"
+#include "app-devices.h"
+#include "app-handlers.h"
+#include "app-interrupts.h"
+#include "app-i2c-sched.h"
+#include "app-utils.h"
+
+#define CASCADE_ENTRY(parent_pin, child)    {parent_pin, child},
+
+FOR_ALL_CASCADES(static const struct interrupt_cascade_t interrupt_cascade[] = {,
+                 CASCADE_ENTRY, };)
+
+#define CASCADE_BIT(parent_pin, child)      | BIT(io_pins[parent_pin].pin)
+
+
+/*
+ * Multiple-producer, single-consumer event queue.  GPIO callbacks reserve a
+ * slot by advancing the head with a CAS, and mark it ready once filled in.
+ * Only the interrupt thread consumes.
+ */
+static struct io_event_t io_event_queue[IO_EVENT_QUEUE_SIZE];
+static atomic_t io_event_head;
+static atomic_t io_event_tail;
+
+/* Devices that had an event dropped on a full queue, rescanned by the thread */
+static atomic_t io_event_lost;
+
+static K_SEM_DEFINE(io_event_sem, 0, 1);
+
+/*
+ * The PCF8574 port as of the last capture, raw.  Only the interrupt thread
+ * touches it once running, so a read_io_pin() refreshing the cached value in
+ * between can't hide a change.
+ */
+static uint32_t pcf8574_captured;
+
+
+static void interrupt_thread(void *p1, void *p2, void *p3);
+
+/*
+ * Not started until interrupts_start(), as the handlers it dispatches to
+ * need their subsystems initialised.  Events queue up until then.
+ */
+K_THREAD_DEFINE(interrupt_tid, INTERRUPT_THREAD_STACK_SIZE, interrupt_thread,
+                NULL, NULL, NULL, INTERRUPT_THREAD_PRIORITY, 0, SYS_FOREVER_MS);
+
+
+int interrupts_init(void)
+{
+    atomic_clear(&io_event_lost);
+    return 0;
+}
+
+
+static inline bool is_mcp23017(int index)
+{
+    return index >= IODEV_IOEXP0 && index <= IODEV_IOEXP5;
+}
+
+
+/*
+ * The expander drivers' interrupt support is off, we own the interrupt
+ * registers.  The handler pins interrupt on any change (edges are filtered
+ * against INTCAP when serviced).  The cascade inputs on ioexp5 compare against
+ * DEFVAL = 1, so they keep interrupting for as long as a child holds its INT
+ * low and a child can't get lost behind a missed edge.
+ */
+int interrupts_start(void)
+{
+    uint32_t cascade_mask = 0 FOR_ALL_CASCADES(, CASCADE_BIT, );
+    uint8_t buffer[6];
+    uint32_t portval;
+    int ret;
+    
+    for (int i = IODEV_IOEXP0; i <= IODEV_IOEXP5; i++) {
+        const struct io_device_t *device = &io_devices[i];
+        uint16_t addr = device->addr;
+        uint32_t enable = device->interrupt_mask;
+        uint32_t compare = 0;
+        
+        if (i == IODEV_IOEXP5) {
+            enable |= cascade_mask;
+            compare = cascade_mask;
+        }
+        
+        /* GPINTENA/B, DEFVALA/B, INTCONA/B in one burst */
+        buffer[0] = enable & 0xFF;
+        buffer[1] = (enable >> 8) & 0xFF;
+        buffer[2] = compare & 0xFF;
+        buffer[3] = (compare >> 8) & 0xFF;
+        buffer[4] = compare & 0xFF;
+        buffer[5] = (compare >> 8) & 0xFF;
+        
+        /* The PWM worker may already be using the bus by now */
+        i2c_sched_begin(I2C_PRIO_COUNTER, addr);
+        
+        /* One INT line per chip, so port A and B share it */
+        ret = i2c_reg_update_byte(i2c, addr, MCP23017_REG_IOCON,
+                                  MCP23017_IOCON_MIRROR, MCP23017_IOCON_MIRROR);
+        if (ret == 0) {
+            ret = i2c_burst_write(i2c, addr, MCP23017_REG_GPINTENA, buffer,
+                                  sizeof(buffer));
+        }
+        
+        /* IOCON read and write back, then the burst */
+        i2c_sched_end(2 + 2 + 1 + sizeof(buffer));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    
+    /* Prime the PCF8574's state so the first change can be detected */
+    i2c_sched_begin(I2C_PRIO_COUNTER, io_devices[IODEV_IOEXP6].addr);
+    ret = gpio_port_get_raw(*io_devices[IODEV_IOEXP6].pdev, &portval);
+    i2c_sched_end(I2C_BYTES_PORT_READ);
+    if (ret != 0) {
+        return ret;
+    }
+    io_device_update(IODEV_IOEXP6, portval);
+    pcf8574_captured = portval;
+    
+    /* Anything latched before now gets picked up by walking the tree once */
+    atomic_or(&io_event_lost, BIT(IODEV_PORTA));
+    k_sem_give(&io_event_sem);
+    k_thread_start(interrupt_tid);
+
+    return 0;
+}
+
+
+void interrupts_post(enum io_device_names_t device, uint32_t pins)
+{
+    atomic_val_t head;
+    struct io_event_t *event;
+    
+    do {
+        head = atomic_get(&io_event_head);
+        if (head - atomic_get(&io_event_tail) >= IO_EVENT_QUEUE_SIZE) {
+            /* Full.  The thread will go and ask the device what it missed */
+            atomic_or(&io_event_lost, BIT(device));
+            k_sem_give(&io_event_sem);
+            return;
+        }
+    } while (!atomic_cas(&io_event_head, head, head + 1));
+    
+    event = &io_event_queue[head & (IO_EVENT_QUEUE_SIZE - 1)];
+    event->timestamp = k_uptime_get_32();
+    event->pins = pins;
+    event->device = (uint8_t)device;
+    atomic_set(&event->ready, 1);
+
+    k_sem_give(&io_event_sem);
+}
+
+
+static bool interrupts_pop(struct io_event_t *out)
+{
+    atomic_val_t tail = atomic_get(&io_event_tail);
+    struct io_event_t *event = &io_event_queue[tail & (IO_EVENT_QUEUE_SIZE - 1)];
+    
+    if (tail == atomic_get(&io_event_head) || !atomic_get(&event->ready)) {
+        /* Empty, or the producer hasn't finished filling the slot yet */
+        return false;
+    }
+    
+    out->timestamp = event->timestamp;
+    out->pins = event->pins;
+    out->device = event->device;
+    
+    atomic_clear(&event->ready);
+    atomic_set(&io_event_tail, tail + 1);
+    return true;
+}
+
+
+static void interrupt_dispatch(enum io_names_t pin_name, uint32_t state,
+                               uint32_t timestamp)
+{
+    switch(pin_name) {
+        case INT1:
+        case INT2:
+        case INT3:
+        case INT4:
+        case INT5:
+        case INTO:
+            handler_charge_counter(pin_name, state, timestamp);
+            break;
+            
+        case PWRGD1:
+        case PWRGD2:
+        case PWRGD3:
+        case PWRGD4:
+        case PWRGD5:
+            handler_power_good(pin_name);
+            break;
+            
+        case nSTANDBY:
+        case nCHARGE:
+            handler_charger(pin_name);
+            break;
+
+        case UP:
+        case RIGHT:
+        case LEFT:
+        case DOWN:
+        case ENTER:
+        case ESC:
+            handler_button(pin_name);
+            break;
+            
+        default:
+            break;
+    }
+}
+
+
+/*
+ * Read what the device latched at interrupt time.  For the MCP23017s, INTFA/B
+ * and INTCAPA/B are adjacent, so one 4 byte burst gets both the flags and the
+ * captured port, and clears the interrupt.  On a retry, INTCAP still holds
+ * what the first pass already dispatched, so the burst carries on into
+ * GPIOA/B and the port as it is now is used instead.  The PCF8574 has no
+ * flag register, so its flags are whatever inputs changed since the last
+ * read.  The on-chip port's edges arrive already decoded as the callback's
+ * pin mask.
+ */
+static int interrupt_capture(int index, bool retry, uint32_t *flags,
+                             uint32_t *portval)
+{
+    const struct io_device_t *device = &io_devices[index];
+    uint8_t buffer[6];
+    size_t len = retry ? 6 : 4;
+    int ret;
+    
+    if (is_mcp23017(index)) {
+        i2c_sched_begin(I2C_PRIO_COUNTER, device->addr);
+        ret = i2c_burst_read(i2c, device->addr, MCP23017_REG_INTFA, buffer,
+                             len);
+        i2c_sched_end(1 + len);
+        if (ret != 0) {
+            return ret;
+        }
+        
+        *flags = buffer[0] | (buffer[1] << 8);
+        *portval = buffer[len - 2] | (buffer[len - 1] << 8);
+        return 0;
+    }
+    
+    if (index != IODEV_PORTA) {
+        i2c_sched_begin(I2C_PRIO_COUNTER, device->addr);
+    }
+    ret = gpio_port_get_raw(*device->pdev, portval);
+    if (index != IODEV_PORTA) {
+        i2c_sched_end(I2C_BYTES_PORT_READ);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (index == IODEV_PORTA) {
+        *flags = 0;
+    } else {
+        *flags = (*portval ^ pcf8574_captured) & device->input_mask;
+        pcf8574_captured = *portval;
+    }
+    return 0;
+}
+
+
+static void interrupt_service(int index, uint32_t pending, uint32_t timestamp,
+                              bool retry)
+{
+    const struct io_device_t *device = &io_devices[index];
+    uint32_t flags;
+    uint32_t portval;
+    uint32_t edges;
+    
+    if (interrupt_capture(index, retry, &flags, &portval) != 0) {
+        return;
+    }
+    
+    /* A retry only has anything to do where a flag is still up */
+    if (retry && !flags && !pending) {
+        return;
+    }
+    
+    /* The handlers' read_io_pin() calls will see the captured state */
+    io_device_update(index, portval);
+    
+    /* Walk down the tree, but only into the children that flagged */
+    if (index == IODEV_IOEXP5) {
+        for (int i = 0; i < NELEMENTS(interrupt_cascade); i++) {
+            const struct interrupt_cascade_t *cascade = &interrupt_cascade[i];
+            
+            if ((flags & BIT(io_pins[cascade->parent_pin].pin)) != 0) {
+                interrupt_service(cascade->child, 0, timestamp, retry);
+            }
+        }
+    }
+    
+    /* Flags fire on any change, keep only the edges each pin asked for */
+    edges = (~portval & device->falling_mask) | (portval & device->rising_mask);
+    pending = (pending | (flags & edges)) & device->interrupt_mask;
+    
+    for (int i = device->first; pending && i <= device->last; i++) {
+        uint32_t pin_bit = BIT(io_pins[i].pin);
+        
+        if ((pending & pin_bit) == 0) {
+            continue;
+        }
+        pending &= ~pin_bit;
+        
+        if (i == EXT_nINT) {
+            interrupt_service(IODEV_IOEXP5, 0, timestamp, retry);
+        } else {
+            interrupt_dispatch((enum io_names_t)i, io_device_value(index),
+                               timestamp);
+        }
+    }
+}
+
+
+static bool interrupt_tree_asserted(void)
+{
+    uint32_t portval;
+    
+    if (gpio_port_get_raw(porta, &portval) != 0) {
+        return false;
+    }
+    
+    /* EXT_nINT is active low */
+    return (portval & BIT(io_pins[EXT_nINT].pin)) == 0;
+}
+
+
+static void interrupt_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+    
+    struct io_event_t event;
+    uint32_t pending[IODEV_COUNT];
+    uint32_t timestamp[IODEV_COUNT];
+    
+    while (1) {
+        k_sem_take(&io_event_sem, K_FOREVER);
+
+        /* 
+         * Coalesce everything that is queued, so each device is only read
+         * once no matter how many of its pins fired
+         */
+        memset(pending, 0, sizeof(pending));
+
+        while (interrupts_pop(&event)) {
+            if (!pending[event.device]) {
+                /* The oldest event is closest to when things latched */
+                timestamp[event.device] = event.timestamp;
+            }
+            pending[event.device] |= event.pins;
+        }
+        
+        uint32_t lost = (uint32_t)atomic_clear(&io_event_lost);
+        if ((lost & BIT(IODEV_PORTA)) != 0) {
+            pending[IODEV_PORTA] |= BIT(io_pins[EXT_nINT].pin);
+        }
+        
+        for (int i = 0; i < IODEV_COUNT; i++) {
+            if ((lost & BIT(i)) != 0 && !pending[i]) {
+                timestamp[i] = k_uptime_get_32();
+            }
+            if (pending[i] || (lost & BIT(i)) != 0) {
+                interrupt_service(i, pending[i], timestamp[i], false);
+            }
+        }
+        
+        /*
+         * EXT_nINT is edge triggered, so if something asserted while we were
+         * walking the tree, go around again rather than wait for an edge
+         * that will never come.  Only the devices still flagging get
+         * serviced again.
+         */
+        for (int i = 0; i < INTERRUPT_CASCADE_RETRIES && interrupt_tree_asserted(); i++) {
+            interrupt_service(IODEV_IOEXP5, 0, k_uptime_get_32(), true);
+        }
+        
+        if (interrupt_tree_asserted()) {
+            atomic_or(&io_event_lost, BIT(IODEV_PORTA));
+            k_sem_give(&io_event_sem);
+        }
+    }
+}
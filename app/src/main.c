@@ -8,10 +8,17 @@
 #include <kernel.h>
 
 #include "app-gpios.h"
+#include "app-interrupts.h"
+#include "app-i2c-sched.h"
+#include "app-safety-queue.h"
 #include "app-adcs.h"
+#include "app-adc-calibration.h"
 #include "app-charge-counters.h"
+#include "app-charge-journal.h"
+#include "app-retained.h"
 #include "app-input-batteries.h"
 #include "app-charger.h"
+#include "app-mppt.h"
 #include "app-display.h"
 
 
@@ -29,6 +36,27 @@ void main(void)
     
     initialized = false;
 
+    /* Before anything touches an output, see if this is a warm restart */
+    ret = retained_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
+    ret = i2c_sched_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
+    ret = safety_queue_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
+    ret = interrupts_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
     ret = gpios_init();
     if (ret != 0) {
         return main_failed();
@@ -48,6 +76,11 @@ void main(void)
         return main_failed();
     }
     
+    ret = adc_calibration_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+    
     ret = charge_counters_init();
     if (ret != 0) {
         return main_failed();
@@ -63,36 +96,56 @@ void main(void)
         return main_failed();
     }
 
+    ret = mppt_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
+    /* Pick up where the last session left off, before anything reads them */
+    ret = charge_journal_init();
+    if (ret != 0) {
+        return main_failed();
+    }
+
+    /* A warm restart puts the banks back as they were instead */
+    retained_restore();
+    
+    /* Let the PWM worker and the depletion check loose on the banks */
+    input_batteries_start();
+
     ret = display_init();
     if (ret != 0) {
         return main_failed();
     }
 
+    /* Only now is everything the handlers dispatch to ready for them */
+    ret = interrupts_start();
+    if (ret != 0) {
+        return main_failed();
+    }
+
     initialized = true;
+    retained_start();
     
     /* Start the CPU LED pulsing */
     led_pulse_start();
 
-    /* Start ADC readings once a second (it reschedules itself) */
+    /*
+     * Start the ADC rounds, every 250ms with each input read when its own
+     * interval is up (it reschedules itself)
+     */
     adcs_start();
     
-    /* Start the charge counters - once a second, reschedules itself */
-    charge_counters_start();
-
     /* Start the display update work item (it gets scheduled by buttons or 
      * ADC complete) 
      */
     display_start();
 
-    /* Start loop */
-    while (1) {
-        /* Check if batteries are depleted, disable those that are */
-        
-        /* If the enables have changed, reprogram the PWM phases */
-        
-        /* Sleep for 100ms */
-        k_msleep(100);
-    }
+    /* Checkpoint the counters periodically (it reschedules itself) */
+    charge_journal_start();
+
+    /* Tune the banks' duty split for the most power out (it reschedules itself) */
+    mppt_start();
 }
 
 void main_failed(void)
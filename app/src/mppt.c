@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <string.h>
+
+#include "app-utils.h"
+#include "app-devices.h"
+#include "app-charge-counters.h"
+#include "app-input-batteries.h"
+#include "app-mppt.h"
+
+/* The last counter is the one on the output cell */
+#define MPPT_OUTPUT_COUNTER     (CHARGE_COUNTER_COUNT - 1)
+
+/* Its POL pin is high, and the pulses count up, while the cell charges */
+#define MPPT_OUTPUT_CHARGE_SIGN 1
+
+enum mppt_phase_t {
+    MPPT_IDLE,
+    MPPT_SETTLE,
+    MPPT_MEASURE,
+};
+
+struct mppt_sample_t {
+    int64_t energy_q32;
+    uint32_t pulse_count;
+    uint32_t timestamp;
+};
+
+struct mppt_state_t {
+    enum mppt_phase_t phase;
+    uint16_t pwm_mask;
+    int bank;
+    int8_t direction[BATTERY_BANK_COUNT];
+    uint16_t previous_weight;
+    bool have_power;
+    int64_t power;
+    struct mppt_sample_t start;
+    uint32_t measure_start;
+};
+
+static struct k_delayed_work mppt_worker;
+static struct mppt_state_t mppt_state;
+
+
+/*
+ * Everything as of the last output pulse, so a measurement runs from one
+ * pulse to another and isn't thrown by where in between the polls land.
+ */
+static void mppt_sample(struct mppt_sample_t *sample)
+{
+    struct charge_counter_t *counter = &charge_counter[MPPT_OUTPUT_COUNTER];
+    
+    k_sched_lock();
+    sample->energy_q32 = counter->energy_q32;
+    sample->pulse_count = counter->pulse_count;
+    sample->timestamp = counter->last_pulse_time;
+    k_sched_unlock();
+}
+
+/*
+ * Mean power into the output cell between two samples, in mWh (Q32) per ms.
+ * The counter's sign follows its polarity pin, so it is put the right way
+ * round first, and a cell being run down harder comes out as less power.
+ */
+static bool mppt_power(const struct mppt_sample_t *start,
+                       const struct mppt_sample_t *end, int64_t *power)
+{
+    uint32_t elapsed = end->timestamp - start->timestamp;
+    int64_t energy;
+    
+    if (end->pulse_count - start->pulse_count < MPPT_MIN_PULSES || !elapsed) {
+        return false;
+    }
+    
+    energy = (end->energy_q32 - start->energy_q32) * MPPT_OUTPUT_CHARGE_SIGN;
+    *power = energy / elapsed;
+    return true;
+}
+
+static int mppt_next_bank(uint16_t pwm_mask, int bank)
+{
+    for (int i = 1; i <= BATTERY_BANK_COUNT; i++) {
+        int next = (bank + i) % BATTERY_BANK_COUNT;
+        
+        if ((pwm_mask & BIT(next)) != 0) {
+            return next;
+        }
+    }
+    
+    return bank;
+}
+
+static void mppt_perturb(struct mppt_state_t *state, uint16_t *weights)
+{
+    uint32_t weight;
+    uint32_t step;
+    
+    weight = weights[state->bank];
+    state->previous_weight = weight;
+    step = max(1, weight >> MPPT_STEP_SHIFT);
+    if (state->direction[state->bank] > 0) {
+        weight = min(weight + step, UINT16_MAX);
+    } else {
+        weight = max(weight - min(step, weight - 1), 1);
+    }
+    weights[state->bank] = weight;
+}
+
+/*
+ * Fewer than two banks running leaves nothing to split, and a change in the
+ * running banks gets them all reweighed, so either way start over.
+ */
+static void mppt_restart(struct mppt_state_t *state)
+{
+    uint16_t pwm_mask = battery_pwm_mask();
+    
+    state->pwm_mask = pwm_mask;
+    state->have_power = false;
+    state->bank = BATTERY_BANK_COUNT - 1;
+    state->phase = MPPT_IDLE;
+    
+    if (__builtin_popcount(pwm_mask) >= 2) {
+        state->phase = MPPT_SETTLE;
+    }
+}
+
+static void mppt_worker_fn(struct k_work *work)
+{
+    struct mppt_state_t *state = &mppt_state;
+    struct mppt_sample_t sample;
+    uint16_t weights[BATTERY_BANK_COUNT];
+    uint32_t delay_ms = MPPT_POLL_MS;
+    int64_t power;
+    
+    if (battery_pwm_mask() != state->pwm_mask) {
+        mppt_restart(state);
+        delay_ms = MPPT_SETTLE_MS;
+        goto done;
+    }
+    
+    switch (state->phase) {
+        case MPPT_IDLE:
+            break;
+            
+        case MPPT_SETTLE:
+            mppt_sample(&state->start);
+            state->measure_start = k_uptime_get_32();
+            state->phase = MPPT_MEASURE;
+            break;
+            
+        case MPPT_MEASURE:
+            mppt_sample(&sample);
+            if (!mppt_power(&state->start, &sample, &power)) {
+                if (k_uptime_get_32() - state->measure_start < MPPT_MAX_DWELL_MS) {
+                    break;
+                }
+                
+                /* Too little coming in to tell anything, try again later */
+                mppt_restart(state);
+                delay_ms = MPPT_MAX_DWELL_MS;
+                break;
+            }
+            
+            /*
+             * The first measurement is just the baseline.  After that, the
+             * only change since the last one is the current bank's
+             * perturbation.  If it hurt, that bank goes back to where it was,
+             * which leaves the baseline standing, and tries the other way
+             * next time round.
+             */
+            battery_pwm_weights(weights);
+            if (state->have_power && power < state->power) {
+                weights[state->bank] = state->previous_weight;
+                state->direction[state->bank] = -state->direction[state->bank];
+            } else {
+                state->power = power;
+                state->have_power = true;
+            }
+            
+            state->bank = mppt_next_bank(state->pwm_mask, state->bank);
+            mppt_perturb(state, weights);
+            battery_pwm_set_weights(weights);
+            state->phase = MPPT_SETTLE;
+            delay_ms = MPPT_SETTLE_MS;
+            break;
+    }
+    
+done:
+    k_delayed_work_submit(&mppt_worker, K_MSEC(delay_ms));
+}
+
+int mppt_init(void)
+{
+    memset(&mppt_state, 0, sizeof(mppt_state));
+    for (int i = 0; i < BATTERY_BANK_COUNT; i++) {
+        mppt_state.direction[i] = 1;
+    }
+    
+    k_delayed_work_init(&mppt_worker, mppt_worker_fn);
+    return 0;
+}
+
+void mppt_start(void)
+{
+    mppt_restart(&mppt_state);
+    k_delayed_work_submit(&mppt_worker, K_MSEC(MPPT_SETTLE_MS));
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <devicetree.h>
+#include <drivers/i2c.h>
+#include <kernel.h>
+
+#include "app-devices.h"
+#include "app-i2c-sched.h"
+#include "app-pwm-frame.h"
+
+
+#define PWM_FRAME_ADDR  DT_REG_ADDR(DT_NODELABEL(pwm))
+
+
+/*
+ * The burst relies on auto-increment, and on the outputs only changing at
+ * the STOP, so make sure of both
+ */
+int pwm_frame_init(void)
+{
+    int ret;
+    
+    i2c_sched_begin(I2C_PRIO_SAFETY, PWM_FRAME_ADDR);
+    ret = i2c_reg_update_byte(i2c, PWM_FRAME_ADDR, PCA9685_REG_MODE1,
+                              PCA9685_MODE1_AI, PCA9685_MODE1_AI);
+    if (ret == 0) {
+        ret = i2c_reg_update_byte(i2c, PWM_FRAME_ADDR, PCA9685_REG_MODE2,
+                                  PCA9685_MODE2_OCH, 0);
+    }
+    i2c_sched_end(8);
+    
+    return ret;
+}
+
+/* Everything full off, which is also the PCA9685's power on state */
+void pwm_frame_clear(struct pwm_frame_t *frame)
+{
+    for (int i = 0; i < PCA9685_CHANNEL_COUNT; i++) {
+        frame->on[i] = 0;
+        frame->off[i] = PWM_FRAME_FULL;
+    }
+    frame->mask = 0;
+}
+
+void pwm_frame_set(struct pwm_frame_t *frame, int channel, uint16_t on,
+                   uint16_t off)
+{
+    frame->on[channel] = on;
+    frame->off[channel] = off;
+    frame->mask |= BIT(channel);
+}
+
+void pwm_frame_set_off(struct pwm_frame_t *frame, int channel)
+{
+    pwm_frame_set(frame, channel, 0, PWM_FRAME_FULL);
+}
+
+int pwm_frame_write(const struct pwm_frame_t *frame)
+{
+    uint8_t buffer[4 * PCA9685_CHANNEL_COUNT];
+    uint8_t *p = buffer;
+    int first;
+    int last;
+    int ret;
+    
+    if (!frame->mask) {
+        return 0;
+    }
+    
+    first = find_lsb_set(frame->mask) - 1;
+    last = find_msb_set(frame->mask) - 1;
+    
+    for (int i = first; i <= last; i++) {
+        *p++ = frame->on[i] & 0xFF;
+        *p++ = frame->on[i] >> 8;
+        *p++ = frame->off[i] & 0xFF;
+        *p++ = frame->off[i] >> 8;
+    }
+    
+    i2c_sched_begin(I2C_PRIO_SAFETY, PWM_FRAME_ADDR);
+    ret = i2c_burst_write(i2c, PWM_FRAME_ADDR, PCA9685_REG_LED(first),
+                          buffer, p - buffer);
+    i2c_sched_end(2 + (p - buffer));
+    
+    return ret;
+}
+
+static bool pwm_frame_is_on(const struct pwm_frame_t *frame, int channel)
+{
+    return (frame->off[channel] & PWM_FRAME_FULL) == 0;
+}
+
+static bool pwm_frame_same(const struct pwm_frame_t *a,
+                           const struct pwm_frame_t *b, int channel)
+{
+    return a->on[channel] == b->on[channel] &&
+           a->off[channel] == b->off[channel];
+}
+
+/* Does outer's window cover all of inner's? */
+static bool pwm_frame_covers(const struct pwm_frame_t *outer,
+                             const struct pwm_frame_t *inner, int channel)
+{
+    if (!pwm_frame_is_on(inner, channel)) {
+        return true;
+    }
+    
+    if (!pwm_frame_is_on(outer, channel)) {
+        return false;
+    }
+    
+    return outer->on[channel] <= inner->on[channel] &&
+           inner->off[channel] <= outer->off[channel];
+}
+
+/*
+ * Move the chip from current to target without two channels' windows ever
+ * overlapping, and without touching channels that don't change.
+ *
+ * A register write only takes effect at the next ON or OFF match, so a
+ * window that is widened in place is safe: wherever the counter is, the
+ * output stays inside the new window.  Narrowing or moving one is not, as an
+ * output caught on past its new OFF stays on until that OFF comes round
+ * again, right through the other windows.  So:
+ *
+ *   1. break: channels that are on and whose new window doesn't cover the
+ *      old one go full off, which is immediate
+ *   2. wait out a PWM period
+ *   3. make: every changed channel gets its new window, in one burst
+ *
+ * Channels that are unchanged, or only widen, keep running throughout.
+ * current is left holding what was actually written.
+ */
+int pwm_frame_transition(struct pwm_frame_t *current,
+                         const struct pwm_frame_t *target)
+{
+    struct pwm_frame_t next = *current;
+    uint16_t changed = 0;
+    int ret;
+    
+    next.mask = 0;
+    for (int i = 0; i < PCA9685_CHANNEL_COUNT; i++) {
+        if ((target->mask & BIT(i)) == 0 || pwm_frame_same(current, target, i)) {
+            continue;
+        }
+        
+        changed |= BIT(i);
+        if (pwm_frame_is_on(current, i) && !pwm_frame_covers(target, current, i)) {
+            pwm_frame_set_off(&next, i);
+        }
+    }
+    
+    if (next.mask) {
+        ret = pwm_frame_write(&next);
+        if (ret != 0) {
+            return ret;
+        }
+        
+        *current = next;
+        current->mask = 0;
+        k_msleep(PWM_FRAME_SETTLE_MS);
+    }
+    
+    next = *current;
+    next.mask = 0;
+    for (int i = 0; i < PCA9685_CHANNEL_COUNT; i++) {
+        if ((changed & BIT(i)) != 0) {
+            pwm_frame_set(&next, i, target->on[i], target->off[i]);
+        }
+    }
+    
+    ret = pwm_frame_write(&next);
+    if (ret == 0) {
+        *current = next;
+        current->mask = 0;
+    }
+    
+    return ret;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <string.h>
+#include <sys/crc.h>
+#include <linker/section_tags.h>
+
+#include "app-utils.h"
+#include "app-gpios.h"
+#include "app-input-batteries.h"
+#include "app-charge-journal.h"
+#include "app-retained.h"
+
+
+static __noinit struct retained_state_t retained_state;
+
+static bool retained_warm;
+static bool retained_journal_ok;
+static bool retained_running;
+
+static struct k_delayed_work retained_journal_worker;
+static atomic_t retained_journal_pending;
+
+
+static uint32_t retained_crc(const void *data, size_t len)
+{
+    return crc32_ieee((const uint8_t *)data, len);
+}
+
+/* Has to be the very first thing, before gpios_init() touches any output */
+int retained_init(void)
+{
+    struct retained_state_t *state = &retained_state;
+    
+    retained_running = false;
+    retained_warm = (state->magic == RETAINED_MAGIC &&
+                     state->outputs_crc == retained_crc(&state->outputs,
+                                                        sizeof(state->outputs)));
+    retained_journal_ok = (retained_warm &&
+                           state->journal_crc == retained_crc(&state->journal,
+                                                              sizeof(state->journal)));
+    return 0;
+}
+
+/* Whether the journal is there to restore from, rather than flash */
+bool retained_journal_valid(void)
+{
+    return retained_journal_ok;
+}
+
+/* The output's level from before the reset, if there was a warm one */
+bool retained_output(enum io_names_t io_name, bool *value)
+{
+    if (!retained_warm) {
+        return false;
+    }
+    
+    uint32_t outputs = retained_state.outputs.outputs[io_pin_device[io_name]];
+    *value = (outputs & BIT(io_pins[io_name].pin)) != 0;
+    return true;
+}
+
+/*
+ * The outputs are already back where they were.  This puts the software
+ * state back to match them, before the PWM worker is let loose on it, so it
+ * finds nothing to change when it first runs.
+ */
+void retained_restore(void)
+{
+    const struct retained_outputs_t *outputs = &retained_state.outputs;
+    
+    if (!retained_warm) {
+        return;
+    }
+    
+    for (int i = 0; i < battery_count; i++) {
+        battery_worker[i].power_good = (outputs->power_good_mask & BIT(i)) != 0;
+        battery_worker[i].enabled = (outputs->enabled_mask & BIT(i)) != 0;
+    }
+    battery_pwm_restore(outputs->pwm_mask, outputs->pwm_weights);
+    
+    if (retained_journal_ok) {
+        charge_journal_apply(&retained_state.journal, true);
+    }
+}
+
+static void retained_journal_flush(void)
+{
+    struct charge_journal_t journal;
+    
+    atomic_clear(&retained_journal_pending);
+    charge_journal_snapshot(&journal);
+    
+    /* Only this writes the journal, and a torn write just fails its CRC */
+    retained_state.journal = journal;
+    retained_state.journal_crc = retained_crc(&journal, sizeof(journal));
+}
+
+static void retained_journal_worker_fn(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    
+    retained_journal_flush();
+}
+
+/* From here on, every change to the state is mirrored */
+void retained_start(void)
+{
+    k_delayed_work_init(&retained_journal_worker, retained_journal_worker_fn);
+    retained_running = true;
+    retained_update();
+    retained_journal_flush();
+}
+
+void retained_update(void)
+{
+    struct retained_state_t *state = &retained_state;
+    struct retained_outputs_t outputs;
+    
+    if (!retained_running) {
+        return;
+    }
+    
+    memset(&outputs, 0, sizeof(outputs));
+    for (int i = 0; i < IODEV_COUNT; i++) {
+        uint32_t pending = io_device_pending(i);
+        
+        outputs.outputs[i] = io_device_value(i) & io_devices[i].output_mask;
+        
+        /*
+         * A failed write leaves its pins at their old levels, so those stay
+         * as last retained until a retry gets through.
+         */
+        if (pending && state->magic == RETAINED_MAGIC) {
+            outputs.outputs[i] = (outputs.outputs[i] & ~pending) |
+                                 (state->outputs.outputs[i] & pending);
+        }
+    }
+    for (int i = 0; i < battery_count; i++) {
+        if (battery_worker[i].power_good) {
+            outputs.power_good_mask |= BIT(i);
+        }
+        if (battery_worker[i].enabled) {
+            outputs.enabled_mask |= BIT(i);
+        }
+    }
+    outputs.pwm_mask = battery_pwm_mask();
+    battery_pwm_weights(outputs.pwm_weights);
+    
+    k_sched_lock();
+    if (state->magic != RETAINED_MAGIC ||
+        memcmp(&state->outputs, &outputs, sizeof(outputs)) != 0) {
+        state->magic = RETAINED_MAGIC;
+        state->outputs = outputs;
+        state->outputs_crc = retained_crc(&outputs, sizeof(outputs));
+    }
+    k_sched_unlock();
+}
+
+/* Cheap enough for every counter pulse, the work is done later */
+void retained_journal_dirty(void)
+{
+    if (!retained_running) {
+        return;
+    }
+    
+    if (!atomic_set(&retained_journal_pending, 1)) {
+        k_delayed_work_submit(&retained_journal_worker,
+                              K_MSEC(RETAINED_JOURNAL_FLUSH_MS));
+    }
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2020 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+
+#include "app-safety-queue.h"
+
+
+K_THREAD_STACK_DEFINE(safety_queue_stack, SAFETY_QUEUE_STACK_SIZE);
+
+struct k_work_q safety_work_q;
+
+
+int safety_queue_init(void)
+{
+    k_work_q_start(&safety_work_q, safety_queue_stack,
+                   K_THREAD_STACK_SIZEOF(safety_queue_stack),
+                   SAFETY_QUEUE_PRIORITY);
+    return 0;
+}